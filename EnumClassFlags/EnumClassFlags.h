@@ -1,6 +1,8 @@
 #ifndef __INCLUDED_ENUMCLASSFLAGS_H
 #define __INCLUDED_ENUMCLASSFLAGS_H
 #include <type_traits>
+#include <cstddef>
+#include <atomic>
 
 template <typename T>
 struct is_flag_enum
@@ -27,8 +29,8 @@ static const bool value = true;\
 template <int size>
 struct integral_by_size
 {
-	static_assert(size > sizeof(size_t), "Size must be smaller than sizeof(size_t).");
-	typedef size_t type;
+	static_assert(size <= sizeof(std::size_t), "Size must not be larger than sizeof(size_t).");
+	typedef std::size_t type;
 };
 
 template <>
@@ -49,19 +51,197 @@ struct integral_by_size<4>
 	typedef unsigned int type;
 };
 
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type operator~ (T a) { return (T)~(integral_by_size<sizeof(T)>::type)a; }
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type operator| (T a, T b) { return (T)((integral_by_size<sizeof(T)>::type)a | (integral_by_size<sizeof(T)>::type)b); }
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type operator& (T a, T b) { return (T)((integral_by_size<sizeof(T)>::type)a & (integral_by_size<sizeof(T)>::type)b); }
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type operator^ (T a, T b) { return (T)((integral_by_size<sizeof(T)>::type)a ^ (integral_by_size<sizeof(T)>::type)b); }
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type& operator|= (T& a, T b) { return (T&)((integral_by_size<sizeof(T)>::type&)a |= (integral_by_size<sizeof(T)>::type)b); }
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type& operator&= (T& a, T b) { return (T&)((integral_by_size<sizeof(T)>::type&)a &= (integral_by_size<sizeof(T)>::type)b); }
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type& operator^= (T& a, T b) { return (T&)((integral_by_size<sizeof(T)>::type&)a ^= (integral_by_size<sizeof(T)>::type)b); }
+// The compound operators mutate their argument, which constexpr only allows
+// since C++14; in C++11 they fall back to plain inline.
+#if __cplusplus >= 201402L
+#define _FLAG_ENUM_CONSTEXPR14 constexpr
+#else
+#define _FLAG_ENUM_CONSTEXPR14 inline
+#endif
+
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, T>::type operator~ (T a) noexcept { return (T)~(typename integral_by_size<sizeof(T)>::type)a; }
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, T>::type operator| (T a, T b) noexcept { return (T)((typename integral_by_size<sizeof(T)>::type)a | (typename integral_by_size<sizeof(T)>::type)b); }
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, T>::type operator& (T a, T b) noexcept { return (T)((typename integral_by_size<sizeof(T)>::type)a & (typename integral_by_size<sizeof(T)>::type)b); }
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, T>::type operator^ (T a, T b) noexcept { return (T)((typename integral_by_size<sizeof(T)>::type)a ^ (typename integral_by_size<sizeof(T)>::type)b); }
+template<typename T> _FLAG_ENUM_CONSTEXPR14 typename std::enable_if<is_flag_enum<T>::value, T>::type& operator|= (T& a, T b) noexcept { a = a | b; return a; }
+template<typename T> _FLAG_ENUM_CONSTEXPR14 typename std::enable_if<is_flag_enum<T>::value, T>::type& operator&= (T& a, T b) noexcept { a = a & b; return a; }
+template<typename T> _FLAG_ENUM_CONSTEXPR14 typename std::enable_if<is_flag_enum<T>::value, T>::type& operator^= (T& a, T b) noexcept { a = a ^ b; return a; }
 
 #ifdef _USE_FLAG_ENUM_CLASS_FUNCTIONS
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, bool>::type TestFlag(T a, T b) { return ((integral_by_size<sizeof(T)>::type)(a&b) != 0); }
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type& SetFlag(T& a, T b) { return (a |= b);}
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type& ClearFlag(T& a, T b) { return (a &= ~b); }
-template<typename T> inline typename std::enable_if<is_flag_enum<T>::value, T>::type& FlipFlag(T&a, T b) { return (a ^= b); }
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, bool>::type TestFlag(T a, T b) noexcept { return ((typename integral_by_size<sizeof(T)>::type)(a&b) != 0); }
+template<typename T> _FLAG_ENUM_CONSTEXPR14 typename std::enable_if<is_flag_enum<T>::value, T>::type& SetFlag(T& a, T b) noexcept { return (a |= b);}
+template<typename T> _FLAG_ENUM_CONSTEXPR14 typename std::enable_if<is_flag_enum<T>::value, T>::type& ClearFlag(T& a, T b) noexcept { return (a &= ~b); }
+template<typename T> _FLAG_ENUM_CONSTEXPR14 typename std::enable_if<is_flag_enum<T>::value, T>::type& FlipFlag(T&a, T b) noexcept { return (a ^= b); }
 #endif // _USE_FLAG_ENUM_CLASS_FUNCTIONS
 
+// Bit-scan utilities for flag enums: counting and locating set flags
+// maps to single instructions through the compiler builtins where
+// available, with constexpr recursive fallbacks elsewhere.
+#if defined(__GNUC__) || defined(__clang__)
+#define _FLAG_ENUM_HAS_BUILTINS 1
+#endif
+
+constexpr unsigned long long _flag_enum_highest_bit(unsigned long long w) noexcept { return (w & (w - 1)) ? _flag_enum_highest_bit(w & (w - 1)) : w; }
+constexpr int _flag_enum_popcount(unsigned long long w) noexcept { return w ? (int)(w & 1) + _flag_enum_popcount(w >> 1) : 0; }
+
+#ifdef _FLAG_ENUM_HAS_BUILTINS
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, int>::type popcount(T a) noexcept { return __builtin_popcountll((unsigned long long)(typename integral_by_size<sizeof(T)>::type)a); }
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, T>::type highest_flag(T a) noexcept { return (T)(typename integral_by_size<sizeof(T)>::type)((typename integral_by_size<sizeof(T)>::type)a ? (1ull << (63 - __builtin_clzll((unsigned long long)(typename integral_by_size<sizeof(T)>::type)a))) : 0ull); }
+#else
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, int>::type popcount(T a) noexcept { return _flag_enum_popcount((unsigned long long)(typename integral_by_size<sizeof(T)>::type)a); }
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, T>::type highest_flag(T a) noexcept { return (T)(typename integral_by_size<sizeof(T)>::type)_flag_enum_highest_bit((unsigned long long)(typename integral_by_size<sizeof(T)>::type)a); }
+#endif // _FLAG_ENUM_HAS_BUILTINS
+
+// w & -w isolates the lowest set bit; no intrinsic needed.
+template<typename T> constexpr typename std::enable_if<is_flag_enum<T>::value, T>::type lowest_flag(T a) noexcept { return (T)(typename integral_by_size<sizeof(T)>::type)((typename integral_by_size<sizeof(T)>::type)a & (typename integral_by_size<sizeof(T)>::type)(~(typename integral_by_size<sizeof(T)>::type)a + 1)); }
+
+// Calls func once per set flag, lowest first, each time with a value
+// holding exactly that one flag. Clearing the lowest bit per step
+// makes the loop proportional to the set bits, not the enum's width.
+template<typename T, typename FuncT>
+inline typename std::enable_if<is_flag_enum<T>::value, void>::type for_each_flag(T a, FuncT func)
+{
+	typedef typename integral_by_size<sizeof(T)>::type word_type;
+	word_type w = (word_type)a;
+	while(w) {
+		word_type bit = (word_type)(w & (word_type)(~w + 1));
+		func((T)bit);
+		w = (word_type)(w & (w - 1));
+	}
+}
+
+// Lock-free flag word for flag enums shared across threads: every
+// operation is a single atomic read-modify-write on the underlying
+// integral_by_size word, replacing a mutex around a plain enum. Memory
+// orders default to sequential consistency like std::atomic itself.
+template <typename T>
+class atomic_flags
+{
+	static_assert(is_flag_enum<T>::value, "atomic_flags requires a flag enum.");
+	typedef typename integral_by_size<sizeof(T)>::type word_type;
+
+public:
+	atomic_flags() noexcept : m_word(0) {}
+	constexpr atomic_flags(T value) noexcept : m_word((word_type)value) {}
+	atomic_flags(const atomic_flags&) = delete;
+	atomic_flags& operator=(const atomic_flags&) = delete;
+
+	bool is_lock_free() const noexcept { return m_word.is_lock_free(); }
+
+	T load(std::memory_order order = std::memory_order_seq_cst) const noexcept { return (T)m_word.load(order); }
+	void store(T value, std::memory_order order = std::memory_order_seq_cst) noexcept { m_word.store((word_type)value, order); }
+	T exchange(T value, std::memory_order order = std::memory_order_seq_cst) noexcept { return (T)m_word.exchange((word_type)value, order); }
+
+	// The fetch operations return the previous value, like std::atomic.
+	T fetch_or(T flags, std::memory_order order = std::memory_order_seq_cst) noexcept { return (T)m_word.fetch_or((word_type)flags, order); }
+	T fetch_and(T flags, std::memory_order order = std::memory_order_seq_cst) noexcept { return (T)m_word.fetch_and((word_type)flags, order); }
+	T fetch_xor(T flags, std::memory_order order = std::memory_order_seq_cst) noexcept { return (T)m_word.fetch_xor((word_type)flags, order); }
+
+	// Sets the flags and reports whether any of them was already set.
+	bool test_and_set(T flags, std::memory_order order = std::memory_order_seq_cst) noexcept { return (((word_type)fetch_or(flags, order) & (word_type)flags) != 0); }
+	// Clears the flags; returns the previous value.
+	T clear(T flags, std::memory_order order = std::memory_order_seq_cst) noexcept { return fetch_and(~flags, order); }
+	// True if any of the given flags is currently set.
+	bool test(T flags, std::memory_order order = std::memory_order_seq_cst) const noexcept { return (((word_type)load(order) & (word_type)flags) != 0); }
+
+	bool compare_exchange_weak(T& expected, T desired, std::memory_order success, std::memory_order failure) noexcept
+	{
+		word_type e = (word_type)expected;
+		bool ok = m_word.compare_exchange_weak(e, (word_type)desired, success, failure);
+		expected = (T)e;
+		return ok;
+	}
+	bool compare_exchange_weak(T& expected, T desired, std::memory_order order = std::memory_order_seq_cst) noexcept { return compare_exchange_weak(expected, desired, order, order == std::memory_order_acq_rel ? std::memory_order_acquire : (order == std::memory_order_release ? std::memory_order_relaxed : order)); }
+
+	bool compare_exchange_strong(T& expected, T desired, std::memory_order success, std::memory_order failure) noexcept
+	{
+		word_type e = (word_type)expected;
+		bool ok = m_word.compare_exchange_strong(e, (word_type)desired, success, failure);
+		expected = (T)e;
+		return ok;
+	}
+	bool compare_exchange_strong(T& expected, T desired, std::memory_order order = std::memory_order_seq_cst) noexcept { return compare_exchange_strong(expected, desired, order, order == std::memory_order_acq_rel ? std::memory_order_acquire : (order == std::memory_order_release ? std::memory_order_relaxed : order)); }
+
+private:
+	std::atomic<word_type> m_word;
+};
+
+// Fixed-size flag set for enums that outgrow a single word: the
+// enumerators are bit indices (0..N-1) rather than one-bit masks, and
+// the set packs them into a contiguous, word-aligned array of
+// integral_by_size words. Combining two sets is plain word-wise ops
+// over that array, which the compiler can unroll or vectorize.
+template <typename T, std::size_t N>
+class flag_set
+{
+	static_assert(is_flag_enum<T>::value, "flag_set requires a flag enum.");
+	static_assert(N > 0, "flag_set needs at least one flag.");
+	typedef typename integral_by_size<sizeof(std::size_t)>::type word_type;
+	static const std::size_t word_bits = sizeof(word_type) * 8;
+	static const std::size_t word_count = (N + word_bits - 1) / word_bits;
+
+public:
+	constexpr flag_set() noexcept : m_words{} {}
+
+	_FLAG_ENUM_CONSTEXPR14 flag_set& set(T flag) noexcept { m_words[word_index(flag)] |= word_bit(flag); return *this; }
+	_FLAG_ENUM_CONSTEXPR14 flag_set& clear(T flag) noexcept { m_words[word_index(flag)] &= (word_type)~word_bit(flag); return *this; }
+	_FLAG_ENUM_CONSTEXPR14 flag_set& flip(T flag) noexcept { m_words[word_index(flag)] ^= word_bit(flag); return *this; }
+	constexpr bool test(T flag) const noexcept { return ((m_words[word_index(flag)] & word_bit(flag)) != 0); }
+
+	constexpr bool any() const noexcept { return any_from(0); }
+	constexpr bool none() const noexcept { return !any_from(0); }
+	// True if all N flags are set; the unused bits of the last word are ignored.
+	constexpr bool all() const noexcept { return all_from(0); }
+	// Number of set flags across all words.
+	constexpr int count() const noexcept { return count_from(0); }
+
+	_FLAG_ENUM_CONSTEXPR14 flag_set& operator|=(const flag_set& other) noexcept { for(std::size_t i = 0; i < word_count; ++i) m_words[i] |= other.m_words[i]; return *this; }
+	_FLAG_ENUM_CONSTEXPR14 flag_set& operator&=(const flag_set& other) noexcept { for(std::size_t i = 0; i < word_count; ++i) m_words[i] &= other.m_words[i]; return *this; }
+	_FLAG_ENUM_CONSTEXPR14 flag_set& operator^=(const flag_set& other) noexcept { for(std::size_t i = 0; i < word_count; ++i) m_words[i] ^= other.m_words[i]; return *this; }
+
+	friend _FLAG_ENUM_CONSTEXPR14 flag_set operator|(flag_set a, const flag_set& b) noexcept { a |= b; return a; }
+	friend _FLAG_ENUM_CONSTEXPR14 flag_set operator&(flag_set a, const flag_set& b) noexcept { a &= b; return a; }
+	friend _FLAG_ENUM_CONSTEXPR14 flag_set operator^(flag_set a, const flag_set& b) noexcept { a ^= b; return a; }
+
+	constexpr bool operator==(const flag_set& other) const noexcept { return equal_from(other, 0); }
+	constexpr bool operator!=(const flag_set& other) const noexcept { return !equal_from(other, 0); }
+
+private:
+	static constexpr std::size_t word_index(T flag) noexcept { return (std::size_t)flag / word_bits; }
+	static constexpr word_type word_bit(T flag) noexcept { return (word_type)((word_type)1 << ((std::size_t)flag % word_bits)); }
+	// Full words compare against ~0; the last word only against the bits N covers.
+	static constexpr word_type word_mask(std::size_t i) noexcept { return (i + 1 < word_count || N % word_bits == 0) ? (word_type)~(word_type)0 : (word_type)(((word_type)1 << (N % word_bits)) - 1); }
+#ifdef _FLAG_ENUM_HAS_BUILTINS
+	static constexpr int pop_word(word_type w) noexcept { return __builtin_popcountll((unsigned long long)w); }
+#else
+	static constexpr int pop_word(word_type w) noexcept { return _flag_enum_popcount((unsigned long long)w); }
+#endif
+	// Recursive so they stay constexpr under C++11.
+	constexpr bool any_from(std::size_t i) const noexcept { return i < word_count && (m_words[i] != 0 || any_from(i + 1)); }
+	constexpr bool all_from(std::size_t i) const noexcept { return i >= word_count || (m_words[i] == word_mask(i) && all_from(i + 1)); }
+	constexpr int count_from(std::size_t i) const noexcept { return i < word_count ? pop_word(m_words[i]) + count_from(i + 1) : 0; }
+	constexpr bool equal_from(const flag_set& other, std::size_t i) const noexcept { return i >= word_count || (m_words[i] == other.m_words[i] && equal_from(other, i + 1)); }
+
+	word_type m_words[word_count];
+};
+
+// Compile-time self-test: define _FLAG_ENUM_CLASS_STATIC_TESTS in one
+// translation unit and the operators prove themselves via static_assert.
+// Lives at global scope because DEFINE_FLAG_ENUM_CLASS specializes
+// is_flag_enum, which is not allowed from inside another namespace.
+#ifdef _FLAG_ENUM_CLASS_STATIC_TESTS
+DEFINE_FLAG_ENUM_CLASS(_flag_enum_static_test)
+{
+	none = 0,
+	a = 1,
+	b = 2,
+	c = 4
+};
+static_assert((_flag_enum_static_test::a | _flag_enum_static_test::b) == (_flag_enum_static_test)3, "operator| must fold at compile time");
+static_assert(((_flag_enum_static_test)3 & _flag_enum_static_test::b) == _flag_enum_static_test::b, "operator& must fold at compile time");
+static_assert((_flag_enum_static_test::a ^ _flag_enum_static_test::a) == _flag_enum_static_test::none, "operator^ must fold at compile time");
+static_assert((~_flag_enum_static_test::none & (_flag_enum_static_test)7) == (_flag_enum_static_test)7, "operator~ must fold at compile time");
+static_assert(!flag_set<_flag_enum_static_test, 130>().any(), "a default flag_set must be empty");
+#endif // _FLAG_ENUM_CLASS_STATIC_TESTS
+
 #endif //__INCLUDED_ENUMCLASSFLAGS_H
\ No newline at end of file
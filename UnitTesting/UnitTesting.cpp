@@ -1,5 +1,26 @@
 #include "UnitTesting.h"
 #include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#endif
 
 namespace UnitTesting
 {
@@ -23,12 +44,28 @@ void ResultObject::AddResult(Result result)
 
 ///////////////////////////////////////////////////////////////////////////////
 
+StringPool& StringPool::Instance()
+{
+	static StringPool theInstance;
+	return theInstance;
+}
+
+const std::string& StringPool::Intern(const std::string& str)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return *m_Strings.insert(str).first;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 Info::Info() :
 	env(nullptr),
 	suite(nullptr),
 	test(nullptr),
-	m_Name(""),
-	m_File(""),
+	m_NameLiteral(""),
+	m_FileLiteral(""),
+	m_Name(nullptr),
+	m_File(nullptr),
 	m_Line(0)
 {}
 
@@ -36,25 +73,79 @@ Info::Info(const std::string& name, const std::string& file, int line) :
 	env(nullptr),
 	suite(nullptr),
 	test(nullptr),
-	m_Name(name),
-	m_File(file),
+	m_NameLiteral(nullptr),
+	m_FileLiteral(nullptr),
+	m_Name(&StringPool::Instance().Intern(name)),
+	m_File(&StringPool::Instance().Intern(file)),
+	m_Line(line)
+{}
+
+Info::Info(const char* name, const char* file, int line) :
+	env(nullptr),
+	suite(nullptr),
+	test(nullptr),
+	m_NameLiteral(name),
+	m_FileLiteral(file),
+	m_Name(nullptr),
+	m_File(nullptr),
 	m_Line(line)
 {}
 
+Info::Info(const Info& other) :
+	env(other.env),
+	suite(other.suite),
+	test(other.test),
+	m_NameLiteral(other.m_NameLiteral),
+	m_FileLiteral(other.m_FileLiteral),
+	m_Name(other.m_Name.load(std::memory_order_acquire)),
+	m_File(other.m_File.load(std::memory_order_acquire)),
+	m_Line(other.m_Line)
+{}
+
+Info& Info::operator=(const Info& other)
+{
+	env = other.env;
+	suite = other.suite;
+	test = other.test;
+	m_NameLiteral = other.m_NameLiteral;
+	m_FileLiteral = other.m_FileLiteral;
+	m_Name.store(other.m_Name.load(std::memory_order_acquire),
+			std::memory_order_release);
+	m_File.store(other.m_File.load(std::memory_order_acquire),
+			std::memory_order_release);
+	m_Line = other.m_Line;
+	return *this;
+}
+
 const std::string& Info::GetName() const
 {
-	return m_Name;
+	const std::string* name = m_Name.load(std::memory_order_acquire);
+	if(!name) {
+		name = &StringPool::Instance().Intern(m_NameLiteral);
+		m_Name.store(name, std::memory_order_release);
+	}
+	return *name;
+}
+const std::string& Info::OwnFile() const
+{
+	const std::string* file = m_File.load(std::memory_order_acquire);
+	if(!file) {
+		file = &StringPool::Instance().Intern(m_FileLiteral);
+		m_File.store(file, std::memory_order_release);
+	}
+	return *file;
 }
+
 const std::string& Info::GetFile() const
 {
-	if(m_File.empty()) {
-		if(test && !test->GetInfo().m_File.empty())
-			return test->GetInfo().m_File;
-		if(suite && !suite->GetInfo().m_File.empty())
-			return suite->GetInfo().m_File;
+	if(OwnFile().empty()) {
+		if(test && !test->GetInfo().OwnFile().empty())
+			return test->GetInfo().OwnFile();
+		if(suite && !suite->GetInfo().OwnFile().empty())
+			return suite->GetInfo().OwnFile();
 	}
 
-	return m_File;
+	return OwnFile();
 }
 int Info::GetLine() const
 {
@@ -76,35 +167,350 @@ AssertResult::AssertResult(
 
 ///////////////////////////////////////////////////////////////////////////////
 
-TestContext::TestContext(TestResult& r) :
-	m_Results(r)
+TestContext::TestContext(TestResult& r, const std::atomic<bool>* abandoned) :
+	m_Results(r),
+	m_StartAllocations(GetThreadAllocationCounters()),
+	m_Abandoned(abandoned)
 {}
 
+AllocationCounters TestContext::GetAllocationDelta() const
+{
+	AllocationCounters now = GetThreadAllocationCounters();
+	AllocationCounters delta;
+	delta.allocationCount = now.allocationCount - m_StartAllocations.allocationCount;
+	delta.allocatedBytes = now.allocatedBytes - m_StartAllocations.allocatedBytes;
+	delta.freeCount = now.freeCount - m_StartAllocations.freeCount;
+	return delta;
+}
+
 void TestContext::AddResult(const Info& info,
 		bool result, const std::string& msg)
 {
+	// A body the watchdog abandoned must not reach the callback (or the
+	// run's results): the run has moved on and the callback may already
+	// be destroyed. Its asserts are dropped with the rest of the test.
+	if(m_Abandoned && m_Abandoned->load(std::memory_order_acquire))
+		return;
+
 	Info i = info;
 	i.test = &m_Results.GetTest();
 	i.suite = &i.test->GetSuite();
 	i.env = &i.suite->GetEnvironment();
 	AssertResult assertResult(info, result?Result::Success:Result::Fail, msg);
-	i.test->GetSuite().GetEnvironment().GetControl()->OnAssert(assertResult);
-	m_Results.AddResult(assertResult);
+	const Environment& env = i.test->GetSuite().GetEnvironment();
+	env.ReportAssert(assertResult);
+	m_Results.AddResult(std::move(assertResult));
+}
+
+void TestContext::CheckFailed(const Info& info, const std::string& msg)
+{
+	AddResult(info, false, msg);
+}
+
+void TestContext::CheckFailedFormat(const Info& info, const char* format, ...)
+{
+	char buffer[512];
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	if(written < 0) {
+		AddResult(info, false, format);
+		return;
+	}
+
+	// vsnprintf truncates into the buffer but reports the full length.
+	size_t length = std::min((size_t)written, sizeof(buffer) - 1);
+	AddResult(info, false, std::string(buffer, length));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+CaseContext::CaseContext(TestContext& ctx, const Info& info,
+		std::mutex* failMutex) :
+	m_Ctx(ctx),
+	m_Info(info),
+	m_FailMutex(failMutex),
+	m_Passed(0),
+	m_Index(0)
+{}
+
+void CaseContext::CheckFailed(const char* expression)
+{
+	std::ostringstream msg;
+	msg << "case " << m_Index << ": " << expression;
+	if(m_FailMutex) {
+		// Batches of the same test may fail concurrently; only the
+		// failure path pays for this lock.
+		std::lock_guard<std::mutex> lock(*m_FailMutex);
+		m_Ctx.CheckFailed(m_Info, msg.str());
+	} else {
+		m_Ctx.CheckFailed(m_Info, msg.str());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+AllocationCounters::AllocationCounters() :
+	allocationCount(0),
+	allocatedBytes(0),
+	freeCount(0)
+{}
+
+static thread_local AllocationCounters g_ThreadAllocations;
+
+AllocationCounters GetThreadAllocationCounters()
+{
+	return g_ThreadAllocations;
+}
+
+void CountAllocation(size_t bytes)
+{
+	++g_ThreadAllocations.allocationCount;
+	g_ThreadAllocations.allocatedBytes += bytes;
+}
+
+void CountFree()
+{
+	++g_ThreadAllocations.freeCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+PerfCounterValues::PerfCounterValues() :
+	valid(false),
+	instructions(0),
+	cycles(0),
+	cacheMisses(0),
+	branchMisses(0)
+{}
+
+#ifdef __linux__
+// One perf_event group (instructions as leader, cycles, cache misses
+// and branch misses) measuring the current thread in user space only.
+class PerfCounterSampler
+{
+public:
+	PerfCounterSampler(bool open) :
+		m_Leader(-1)
+	{
+		m_Fds[0] = m_Fds[1] = m_Fds[2] = m_Fds[3] = -1;
+		if(!open)
+			return;
+
+		static const std::uint64_t CONFIGS[4] = {
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES
+		};
+
+		for(int i = 0; i < 4; ++i) {
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof(attr);
+			attr.config = CONFIGS[i];
+			attr.read_format = PERF_FORMAT_GROUP;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.disabled = (i == 0) ? 1 : 0;
+
+			m_Fds[i] = (int)syscall(__NR_perf_event_open, &attr,
+					0, -1, m_Leader, 0);
+			if(m_Fds[i] == -1) {
+				CloseAll();
+				return;
+			}
+			if(i == 0)
+				m_Leader = m_Fds[0];
+		}
+	}
+
+	~PerfCounterSampler()
+	{
+		CloseAll();
+	}
+
+	bool IsValid() const
+	{
+		return (m_Leader != -1);
+	}
+
+	void Begin()
+	{
+		ioctl(m_Leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(m_Leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	void End(PerfCounterValues& out)
+	{
+		ioctl(m_Leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+		struct {
+			std::uint64_t nr;
+			std::uint64_t values[4];
+		} data;
+		if(read(m_Leader, &data, sizeof(data)) != sizeof(data) ||
+				data.nr != 4)
+			return;
+
+		out.instructions = data.values[0];
+		out.cycles = data.values[1];
+		out.cacheMisses = data.values[2];
+		out.branchMisses = data.values[3];
+		out.valid = true;
+	}
+
+private:
+	void CloseAll()
+	{
+		for(int i = 0; i < 4; ++i) {
+			if(m_Fds[i] != -1)
+				close(m_Fds[i]);
+			m_Fds[i] = -1;
+		}
+		m_Leader = -1;
+	}
+
+private:
+	int m_Fds[4];
+	int m_Leader;
+};
+#else
+class PerfCounterSampler
+{
+public:
+	PerfCounterSampler(bool open) {}
+	bool IsValid() const { return false; }
+	void Begin() {}
+	void End(PerfCounterValues& out) {}
+};
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+
+BenchmarkStats::BenchmarkStats() :
+	iterations(0),
+	minMilliseconds(0),
+	medianMilliseconds(0),
+	stddevMilliseconds(0),
+	iterationsPerSecond(0)
+{}
+
+///////////////////////////////////////////////////////////////////////////////
+
+StressSpec::StressSpec() :
+	iterations(0),
+	milliseconds(0),
+	fixtureEachIteration(false)
+{}
+
+StressSpec StressSpec::Count(size_t iterations)
+{
+	StressSpec spec;
+	spec.iterations = iterations;
+	return spec;
+}
+
+StressSpec StressSpec::Timed(double milliseconds)
+{
+	StressSpec spec;
+	spec.milliseconds = milliseconds;
+	return spec;
+}
+
+StressSpec StressSpec::FixturePerIteration() const
+{
+	StressSpec spec = *this;
+	spec.fixtureEachIteration = true;
+	return spec;
+}
+
+bool StressSpec::IsActive() const
+{
+	return (iterations > 0 || milliseconds > 0);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
 TestResult::TestResult(Test* test) :
 	m_Test(test),
-	m_Milliseconds(0)
+	m_Retention(ResultRetention::All),
+	m_PassedCheckCount(0),
+	m_Milliseconds(0),
+	m_HasBenchmarkStats(false)
+{}
+
+TestResult::TestResult(Test* test, ResultRetention retention) :
+	m_Test(test),
+	m_Retention(retention),
+	m_PassedCheckCount(0),
+	m_Milliseconds(0),
+	m_HasBenchmarkStats(false)
 {}
 
+void TestResult::SetAllocations(const AllocationCounters& counters)
+{
+	m_Allocations = counters;
+}
+
+const AllocationCounters& TestResult::GetAllocations() const
+{
+	return m_Allocations;
+}
+
+void TestResult::SetPerfCounters(const PerfCounterValues& values)
+{
+	m_PerfCounters = values;
+}
+
+const PerfCounterValues& TestResult::GetPerfCounters() const
+{
+	return m_PerfCounters;
+}
+
+void TestResult::SetBenchmarkStats(const BenchmarkStats& stats)
+{
+	m_BenchmarkStats = stats;
+	m_HasBenchmarkStats = true;
+}
+
+bool TestResult::HasBenchmarkStats() const
+{
+	return m_HasBenchmarkStats;
+}
+
+const BenchmarkStats& TestResult::GetBenchmarkStats() const
+{
+	return m_BenchmarkStats;
+}
+
 void TestResult::AddResult(const AssertResult& result)
 {
+	if(m_Retention == ResultRetention::FailuresOnly &&
+			result.GetTotalResult() == Result::Success) {
+		CountPassedCheck();
+		return;
+	}
+
 	m_Results.push_back(result);
 	ResultObject::AddResult(result.GetTotalResult());
 }
 
+void TestResult::AddResult(AssertResult&& result)
+{
+	if(m_Retention == ResultRetention::FailuresOnly &&
+			result.GetTotalResult() == Result::Success) {
+		CountPassedCheck();
+		return;
+	}
+
+	ResultObject::AddResult(result.GetTotalResult());
+	m_Results.push_back(std::move(result));
+}
+
 size_t TestResult::GetAssertCount() const
 {
 	return m_Results.size();
@@ -134,38 +540,343 @@ double TestResult::GetMilliseconds() const
 
 Test::Test(Suite& s, TestFunction func, const Info& info) :
 	m_Func(func),
-	m_Info(info)
+	m_Info(info),
+	m_Suite(&s),
+	m_IsBenchmark(false)
 {
 	m_Info.test = this;
 	m_Info.suite = &s;
 	m_Info.env = &m_Info.suite->GetEnvironment();
-	
+
 	s.RegisterTest(this);
 }
 
-bool Test::Run(TestResult& result)
+Test::Test(Suite& s, TestFunction func, const Info& info, bool benchmark) :
+	m_Func(func),
+	m_Info(info),
+	m_Suite(&s),
+	m_IsBenchmark(benchmark)
 {
-	TestContext ctx(result);
-	try {
+	m_Info.test = this;
+	m_Info.suite = &s;
+	m_Info.env = &m_Info.suite->GetEnvironment();
+
+	s.RegisterTest(this);
+}
+
+Test::Test(Suite& s, TestFunction func, const Info& info,
+		const StressSpec& stress) :
+	m_Func(func),
+	m_Info(info),
+	m_Suite(&s),
+	m_IsBenchmark(false),
+	m_Stress(stress)
+{
+	m_Info.test = this;
+	m_Info.suite = &s;
+	m_Info.env = &m_Info.suite->GetEnvironment();
+
+	s.RegisterTest(this);
+}
+
+bool Test::IsBenchmark() const
+{
+	return m_IsBenchmark;
+}
+
+bool Test::IsStress() const
+{
+	return m_Stress.IsActive();
+}
+
+bool Test::RunStress(TestResult& result)
+{
+	// Every iteration runs against a failures-only scratch result, so a
+	// million passing iterations never materialize anything; failures
+	// are copied over with their iteration index.
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<double> samples;
+	if(m_Stress.iterations)
+		samples.reserve(m_Stress.iterations);
+	size_t passed = 0;
+	size_t failed = 0;
+	double total = 0;
+	bool procceed = true;
+
+	for(size_t iteration = 0;; ++iteration) {
+		if(m_Stress.iterations && iteration >= m_Stress.iterations)
+			break;
+		if(m_Stress.milliseconds > 0) {
+			std::chrono::duration<double, std::ratio<1, 1000>> elapsed =
+					std::chrono::high_resolution_clock::now() - start;
+			if(elapsed.count() >= m_Stress.milliseconds)
+				break;
+		}
+
+		if(m_Stress.fixtureEachIteration) {
+			if(!m_Suite->ExecFunction(m_Suite->m_Enter, procceed, nullptr))
+				return procceed;
+		}
+
+		TestResult scratch(this, ResultRetention::FailuresOnly);
+		TestContext ctx(scratch);
+		bool threw = false;
+		auto begin = std::chrono::high_resolution_clock::now();
+		try {
+			m_Func(ctx);
+		} catch(...) {
+			threw = true;
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<double, std::ratio<1, 1000>> elapsedMillis =
+				end - begin;
+		samples.push_back(elapsedMillis.count());
+		total += elapsedMillis.count();
+
+		if(m_Stress.fixtureEachIteration) {
+			if(!m_Suite->ExecFunction(m_Suite->m_Leave, procceed, nullptr))
+				return procceed;
+		}
+
+		if(threw) {
+			++failed;
+			std::ostringstream msg;
+			msg << "iteration " << iteration <<
+					": Unknown Exception was thrown.";
+			result.AddResult(AssertResult(GetInfo(), Result::Fail,
+					msg.str()));
+		} else if(scratch.GetTotalResult() != Result::Success) {
+			++failed;
+			for(size_t a = 0; a < scratch.GetAssertCount(); ++a) {
+				const AssertResult& assert = scratch.GetAssert(a);
+				std::ostringstream msg;
+				msg << "iteration " << iteration << ": " << assert.message;
+				result.AddResult(AssertResult(assert.info, Result::Fail,
+						msg.str()));
+			}
+		} else {
+			++passed;
+		}
+	}
+
+	if(!samples.empty()) {
+		std::sort(samples.begin(), samples.end());
+		double mean = total / samples.size();
+		double variance = 0;
+		for(auto it = samples.begin(); it != samples.end(); ++it)
+			variance += (*it - mean) * (*it - mean);
+		variance /= samples.size();
+
+		BenchmarkStats stats;
+		stats.iterations = samples.size();
+		stats.minMilliseconds = samples.front();
+		stats.medianMilliseconds = samples[samples.size() / 2];
+		stats.stddevMilliseconds = std::sqrt(variance);
+		stats.iterationsPerSecond = (total > 0) ?
+				(1000.0 * samples.size() / total) : 0;
+		result.SetBenchmarkStats(stats);
+	}
+
+	result.SetPassedCheckCount(passed);
+	result.SetTime(total);
+	return true;
+}
+
+void Test::RunBenchmark(TestContext& ctx, TestResult& result)
+{
+	// Warmup runs to get code and data caches into a steady state, then
+	// sample until enough total time has accumulated for stable numbers.
+	static const int WARMUP_ITERATIONS = 3;
+	static const size_t MIN_SAMPLES = 16;
+	static const size_t MAX_SAMPLES = 10000;
+	static const double TARGET_MILLISECONDS = 100.0;
+
+	for(int i = 0; i < WARMUP_ITERATIONS; ++i)
+		m_Func(ctx);
+
+	std::vector<double> samples;
+	samples.reserve(MIN_SAMPLES);
+	double total = 0;
+	while(samples.size() < MIN_SAMPLES ||
+			(total < TARGET_MILLISECONDS && samples.size() < MAX_SAMPLES)) {
 		auto begin = std::chrono::high_resolution_clock::now();
 		m_Func(ctx);
 		auto end = std::chrono::high_resolution_clock::now();
-		std::chrono::duration<double, std::ratio<1, 1000>> elapsedMillis = end - begin;
+		std::chrono::duration<double, std::ratio<1, 1000>> elapsedMillis =
+				end - begin;
 
-		result.SetTime(elapsedMillis.count());
+		samples.push_back(elapsedMillis.count());
+		total += elapsedMillis.count();
+	}
+
+	std::sort(samples.begin(), samples.end());
+
+	double mean = total / samples.size();
+	double variance = 0;
+	for(auto it = samples.begin(); it != samples.end(); ++it)
+		variance += (*it - mean) * (*it - mean);
+	variance /= samples.size();
+
+	BenchmarkStats stats;
+	stats.iterations = samples.size();
+	stats.minMilliseconds = samples.front();
+	stats.medianMilliseconds = samples[samples.size() / 2];
+	stats.stddevMilliseconds = std::sqrt(variance);
+	stats.iterationsPerSecond = (total > 0) ?
+			(1000.0 * samples.size() / total) : 0;
+
+	result.SetBenchmarkStats(stats);
+	result.SetTime(stats.medianMilliseconds);
+}
+
+bool Test::HandleException(TestResult& result)
+{
+	const Environment& env = m_Info.suite->GetEnvironment();
+	ControlAction action;
+	{
+		std::lock_guard<std::mutex> lock(env.GetCallbackMutex());
+		action = env.GetControl()->OnException(GetInfo());
+	}
+	if(action == ControlAction::Abort)
+		return false;
+	if(action == ControlAction::AbortCurrent)
+		return true;
+	if(action == ControlAction::Ignore)
+		(void)0;
+	if(action == ControlAction::Procceed)
+		result.AddResult(AssertResult(GetInfo(),
+				Result::Fail, "Unknown Exception was thrown."));
+
+	return true;
+}
+
+bool Test::RunWithWatchdog(TestResult& result, double timeoutMilliseconds)
+{
+	struct WatchdogState
+	{
+		WatchdogState(Test* test, ResultRetention retention) :
+			result(test, retention),
+			abandoned(false),
+			done(false),
+			exception(false)
+		{}
+
+		TestResult result;
+		std::mutex mutex;
+		std::condition_variable cv;
+		// Set once the watchdog gives up; the runner's TestContext
+		// checks it so a body resuming after the timeout cannot call
+		// into a callback that no longer exists.
+		std::atomic<bool> abandoned;
+		bool done;
+		bool exception;
+	};
+
+	auto state = std::make_shared<WatchdogState>(this,
+			m_Info.env->GetResultRetention());
+
+	Test* self = this;
+	std::thread runner([state, self]() {
+		TestContext ctx(state->result, &state->abandoned);
+		bool threw = false;
+		try {
+			// Sampled here on the runner thread, exactly like the
+			// non-watchdog path, so enabling a timeout does not silently
+			// drop the perf-counter values.
+			PerfCounterSampler sampler(
+					self->m_Info.env->GetPerfCountersEnabled());
+
+			if(sampler.IsValid())
+				sampler.Begin();
+			auto begin = std::chrono::high_resolution_clock::now();
+			self->m_Func(ctx);
+			auto end = std::chrono::high_resolution_clock::now();
+			state->result.SetAllocations(ctx.GetAllocationDelta());
+			if(sampler.IsValid()) {
+				PerfCounterValues values;
+				sampler.End(values);
+				state->result.SetPerfCounters(values);
+			}
+			std::chrono::duration<double, std::ratio<1, 1000>> elapsedMillis =
+					end - begin;
+
+			state->result.SetTime(elapsedMillis.count());
+		} catch(...) {
+			threw = true;
+		}
+
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->exception = threw;
+		state->done = true;
+		state->cv.notify_all();
+	});
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	bool finished = state->cv.wait_for(lock,
+			std::chrono::duration<double, std::milli>(timeoutMilliseconds),
+			[&]() { return state->done; });
+
+	if(!finished) {
+		// The body is stuck; abandon its thread and report a timeout.
+		// The detached thread only touches state it keeps alive through
+		// the shared pointer, and the abandoned flag fences it off from
+		// reporting, so the run can safely move on.
+		state->abandoned.store(true, std::memory_order_release);
+		lock.unlock();
+		runner.detach();
+		result.AddResult(AssertResult(GetInfo(), Result::Timeout,
+				"Test timed out."));
+		result.SetTime(timeoutMilliseconds);
+		return true;
+	}
+
+	lock.unlock();
+	runner.join();
+
+	result = std::move(state->result);
+	if(state->exception)
+		return HandleException(result);
+
+	return true;
+}
+
+bool Test::Run(TestResult& result)
+{
+	// Stress tests bound themselves by count or time and aggregate
+	// per-iteration failures, so neither the watchdog nor the normal
+	// single-shot path applies.
+	if(m_Stress.IsActive())
+		return RunStress(result);
+
+	double timeout = m_Info.env->GetTestTimeout();
+	if(!m_IsBenchmark && timeout > 0)
+		return RunWithWatchdog(result, timeout);
+
+	TestContext ctx(result);
+	try {
+		if(m_IsBenchmark) {
+			RunBenchmark(ctx, result);
+		} else {
+			PerfCounterSampler sampler(
+					m_Info.env->GetPerfCountersEnabled());
+
+			if(sampler.IsValid())
+				sampler.Begin();
+			auto begin = std::chrono::high_resolution_clock::now();
+			m_Func(ctx);
+			auto end = std::chrono::high_resolution_clock::now();
+			result.SetAllocations(ctx.GetAllocationDelta());
+			if(sampler.IsValid()) {
+				PerfCounterValues values;
+				sampler.End(values);
+				result.SetPerfCounters(values);
+			}
+			std::chrono::duration<double, std::ratio<1, 1000>> elapsedMillis = end - begin;
+
+			result.SetTime(elapsedMillis.count());
+		}
 	} catch(...) {
-		ControlCallback* callback =
-				m_Info.suite->GetEnvironment().GetControl();
-		ControlAction action = callback->OnException(GetInfo());
-		if(action == ControlAction::Abort)
-			return false;
-		if(action == ControlAction::AbortCurrent)
-			return true;
-		if(action == ControlAction::Ignore)
-			(void)0;
-		if(action == ControlAction::Procceed)
-			result.AddResult(AssertResult(GetInfo(),
-					Result::Fail, "Unknown Exception was thrown."));
+		return HandleException(result);
 	}
 
 	return true;
@@ -184,13 +895,25 @@ const Suite& Test::GetSuite() const
 ///////////////////////////////////////////////////////////////////////////////
 
 SuiteResult::SuiteResult(Suite* suite) :
-	m_Suite(suite)
+	m_Suite(suite),
+	m_Milliseconds(0),
+	m_FixtureMilliseconds(0)
 {}
 
 void SuiteResult::AddResult(const TestResult& result)
 {
+	m_ResultMap.emplace(result.GetTest().GetInfo().GetName(), m_Results.size());
 	m_Results.push_back(result);
+	m_Milliseconds += result.GetMilliseconds();
+	ResultObject::AddResult(result.GetTotalResult());
+}
+
+void SuiteResult::AddResult(TestResult&& result)
+{
+	m_ResultMap.emplace(result.GetTest().GetInfo().GetName(), m_Results.size());
+	m_Milliseconds += result.GetMilliseconds();
 	ResultObject::AddResult(result.GetTotalResult());
+	m_Results.push_back(std::move(result));
 }
 
 size_t SuiteResult::GetResultCount() const
@@ -205,10 +928,9 @@ const TestResult& SuiteResult::GetResult(size_t i) const
 
 const TestResult& SuiteResult::GetResult(const std::string& name) const
 {
-	for(auto it = m_Results.begin(); it != m_Results.end(); ++it) {
-		if(it->GetTest().GetInfo().GetName() == name)
-			return *it;
-	}
+	auto it = m_ResultMap.find(name);
+	if(it != m_ResultMap.end())
+		return m_Results[it->second];
 
 	static TestResult NULL_Result(nullptr);
 	return NULL_Result;
@@ -224,6 +946,21 @@ void SuiteResult::SetTotalResult(Result result)
 	m_TotalResult = result;
 }
 
+double SuiteResult::GetMilliseconds() const
+{
+	return m_Milliseconds;
+}
+
+double SuiteResult::GetFixtureMilliseconds() const
+{
+	return m_FixtureMilliseconds;
+}
+
+void SuiteResult::AddFixtureTime(double t)
+{
+	m_FixtureMilliseconds += t;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 SuiteFunction::SuiteFunction() :
@@ -239,6 +976,11 @@ const Info& SuiteFunction::GetInfo() const
 	return m_Info;
 }
 
+bool SuiteFunction::IsValid() const
+{
+	return (m_Func != nullptr);
+}
+
 void SuiteFunction::operator()() const
 {
 	if(m_Func)
@@ -248,7 +990,8 @@ void SuiteFunction::operator()() const
 ///////////////////////////////////////////////////////////////////////////////
 
 Suite::Suite(Environment& env, const Info& info) :
-	m_Info(info)
+	m_Info(info),
+	m_TagBits(0)
 {
 	m_Info.env = &env;
 	m_Info.suite = this;
@@ -258,37 +1001,191 @@ Suite::Suite(Environment& env, const Info& info) :
 bool Suite::Run(SuiteResult& result)
 {
 	bool procceed;
-	if(!ExecFunction(m_Init, procceed))
+	if(!ExecFunction(m_Init, procceed, &result))
 		return procceed;
-	
-	for(auto it = m_Tests.begin(); it != m_Tests.end(); ++it) {
-		GetEnvironment().GetControl()->OnTestBegin(**it);
-		TestResult testResult(*it);
-		do {
-			testResult = TestResult(*it);
-			if(!ExecFunction(m_Enter, procceed))
-				return procceed;
-		
-			procceed = (*it)->Run(testResult);
-			if(!procceed)
-				return procceed;
 
-			if(!ExecFunction(m_Leave, procceed))
-				return procceed;
-		} while(GetEnvironment().GetControl()->OnTestEnd(testResult));
+	// Suites with per-test fixtures must run their tests serially, since
+	// the fixture functions may share state between enter/test/leave.
+	if(GetEnvironment().GetThreadCount() > 1 &&
+			!m_Enter.IsValid() && !m_Leave.IsValid())
+		procceed = RunTestsParallel(result);
+	else
+		procceed = RunTestsSerial(result);
 
-		result.AddResult(testResult);
-	}
+	if(!procceed)
+		return procceed;
 
-	if(!ExecFunction(m_Exit, procceed))
+	if(!ExecFunction(m_Exit, procceed, &result))
 		return procceed;
 
 	return true;
 }
 
-const std::string& Suite::GetDependency(int i) const
+std::vector<Test*> Suite::OrderedTests() const
 {
-	return m_Dependencies[i];
+	std::vector<Test*> tests = m_Tests;
+	if(GetEnvironment().GetTestOrdering() != TestOrdering::FailureFirst)
+		return tests;
+
+	// Rank 0: failed last run, rank 1: no history, rank 2: passed.
+	// Within a rank the slowest tests come first so a parallel run
+	// packs well.
+	auto rankOf = [this](const Test* test, double& milliseconds) {
+		Result outcome;
+		milliseconds = 0;
+		if(!GetEnvironment().GetCachedOutcome(*test, outcome, milliseconds))
+			return 1;
+		return outcome == Result::Success ? 2 : 0;
+	};
+	std::stable_sort(tests.begin(), tests.end(),
+			[&rankOf](const Test* a, const Test* b) {
+		double millisA, millisB;
+		int rankA = rankOf(a, millisA);
+		int rankB = rankOf(b, millisB);
+		if(rankA != rankB)
+			return rankA < rankB;
+		return millisA > millisB;
+	});
+	return tests;
+}
+
+bool Suite::RunTestsSerial(SuiteResult& result)
+{
+	double suiteTimeout = GetEnvironment().GetSuiteTimeout();
+	auto suiteBegin = std::chrono::high_resolution_clock::now();
+
+	std::vector<Test*> tests = OrderedTests();
+	bool procceed;
+	for(auto it = tests.begin(); it != tests.end(); ++it) {
+		if(suiteTimeout > 0) {
+			std::chrono::duration<double, std::ratio<1, 1000>> elapsed =
+					std::chrono::high_resolution_clock::now() - suiteBegin;
+			if(elapsed.count() > suiteTimeout) {
+				// Skipped tests still go through the callback pair so
+				// listeners see every test the summary counts.
+				GetEnvironment().ReportTestBegin(**it);
+				TestResult testResult(*it, GetEnvironment().GetResultRetention());
+				testResult.AddResult(AssertResult((*it)->GetInfo(),
+						Result::Timeout, "Suite deadline exceeded."));
+				GetEnvironment().ReportTestEnd(testResult);
+				result.AddResult(std::move(testResult));
+				continue;
+			}
+		}
+
+		GetEnvironment().ReportTestBegin(**it);
+		TestResult testResult(*it, GetEnvironment().GetResultRetention());
+		if(GetEnvironment().TryReplayCachedResult(*it, testResult)) {
+			GetEnvironment().ReportTestEnd(testResult);
+			result.AddResult(std::move(testResult));
+			continue;
+		}
+		bool repeat;
+		do {
+			testResult = TestResult(*it, GetEnvironment().GetResultRetention());
+			if(!ExecFunction(m_Enter, procceed, &result))
+				return procceed;
+
+			procceed = (*it)->Run(testResult);
+			if(!procceed)
+				return procceed;
+
+			if(!ExecFunction(m_Leave, procceed, &result))
+				return procceed;
+
+			repeat = GetEnvironment().ReportTestEnd(testResult);
+		} while(repeat);
+
+		GetEnvironment().CheckTimeRegression(testResult);
+		GetEnvironment().CacheTestResult(testResult);
+		result.AddResult(std::move(testResult));
+	}
+
+	return true;
+}
+
+bool Suite::RunTestsParallel(SuiteResult& result)
+{
+	const Environment& env = GetEnvironment();
+	WorkerPool& pool = env.GetWorkerPool();
+
+	std::vector<Test*> tests = OrderedTests();
+	std::vector<TestResult> testResults;
+	testResults.reserve(tests.size());
+	for(auto it = tests.begin(); it != tests.end(); ++it)
+		testResults.push_back(TestResult(*it, env.GetResultRetention()));
+	// A slot is only collected if its task produced a result; on an
+	// abort the untouched default TestResults would otherwise report
+	// never-run tests as Succeeded. One writer per slot, published by
+	// WaitGroup, so plain chars suffice.
+	std::vector<char> ran(tests.size(), 0);
+
+	double suiteTimeout = env.GetSuiteTimeout();
+	auto suiteBegin = std::chrono::high_resolution_clock::now();
+
+	TaskGroup group;
+	std::atomic<bool> procceed(true);
+	for(size_t i = 0; i < tests.size(); ++i) {
+		Test* test = tests[i];
+		TestResult* testResult = &testResults[i];
+		char* ranFlag = &ran[i];
+		pool.Push(group, [this, test, testResult, ranFlag, &procceed,
+				suiteTimeout, suiteBegin]() {
+			if(!procceed)
+				return;
+
+			if(suiteTimeout > 0) {
+				std::chrono::duration<double, std::ratio<1, 1000>> elapsed =
+						std::chrono::high_resolution_clock::now() - suiteBegin;
+				if(elapsed.count() > suiteTimeout) {
+					GetEnvironment().ReportTestBegin(*test);
+					testResult->AddResult(AssertResult(test->GetInfo(),
+							Result::Timeout, "Suite deadline exceeded."));
+					GetEnvironment().ReportTestEnd(*testResult);
+					*ranFlag = 1;
+					return;
+				}
+			}
+
+			GetEnvironment().ReportTestBegin(*test);
+
+			if(GetEnvironment().TryReplayCachedResult(test, *testResult)) {
+				GetEnvironment().ReportTestEnd(*testResult);
+				*ranFlag = 1;
+				return;
+			}
+
+			do {
+				*testResult = TestResult(test,
+						GetEnvironment().GetResultRetention());
+				if(!test->Run(*testResult)) {
+					procceed = false;
+					return;
+				}
+
+				if(!GetEnvironment().ReportTestEnd(*testResult))
+					break;
+			} while(true);
+
+			GetEnvironment().CheckTimeRegression(*testResult);
+			GetEnvironment().CacheTestResult(*testResult);
+			*ranFlag = 1;
+		});
+	}
+
+	pool.WaitGroup(group);
+
+	for(size_t i = 0; i < testResults.size(); ++i) {
+		if(ran[i])
+			result.AddResult(std::move(testResults[i]));
+	}
+
+	return procceed;
+}
+
+const std::string& Suite::GetDependency(int i) const
+{
+	return m_Dependencies[i];
 }
 
 size_t Suite::GetDependencyCount() const
@@ -321,13 +1218,31 @@ void Suite::RegisterDependency(const std::string& name)
 	m_Dependencies.push_back(name);		
 }
 
-bool Suite::ExecFunction(const SuiteFunction& func, bool& procceed)
+// Runs a fixture function; when a result is given its wall time is
+// charged there, so fixture overhead shows up separately from the
+// test times. Passing nullptr discards the time (stress tests already
+// count their per-iteration fixtures in the test time).
+bool Suite::ExecFunction(const SuiteFunction& func, bool& procceed,
+		SuiteResult* result)
 {
+	auto begin = std::chrono::high_resolution_clock::now();
+	auto charge = [&]() {
+		if(result && func.IsValid()) {
+			std::chrono::duration<double, std::ratio<1, 1000>> elapsed =
+					std::chrono::high_resolution_clock::now() - begin;
+			result->AddFixtureTime(elapsed.count());
+		}
+	};
 	try {
 		func();
+		charge();
 	} catch(...) {
-		 ControlAction action = 
-				m_Info.env->GetControl()->OnException(func.GetInfo());
+		charge();
+		 ControlAction action;
+		 {
+			 std::lock_guard<std::mutex> lock(m_Info.env->GetCallbackMutex());
+			 action = m_Info.env->GetControl()->OnException(func.GetInfo());
+		 }
 		 if(action == ControlAction::Ignore || action == ControlAction::Procceed)
 			 (void)0;
 		 else if(action == ControlAction::AbortCurrent) {
@@ -349,9 +1264,19 @@ const Info& Suite::GetInfo() const
 
 bool Suite::CheckTag(const std::string& tag) const
 {
+	size_t id;
+	if(!GetEnvironment().FindTag(tag, id))
+		return false;
+	if(id < 64)
+		return (m_TagBits & ((std::uint64_t)1 << id)) != 0;
 	return (m_Tags.find(tag) != m_Tags.end());
 }
 
+std::uint64_t Suite::GetTagBits() const
+{
+	return m_TagBits;
+}
+
 void Suite::RegisterInit(void (*func)(), Info info)
 {
 	info.env = &GetEnvironment();
@@ -382,252 +1307,2280 @@ void Suite::RegisterFixtureLeave(void (*func)(), Info info)
 
 void Suite::AddTag(const std::string& tag)
 {
-	m_Tags.insert(tag);
+	size_t id = GetEnvironment().InternTag(tag);
+	if(id < 64)
+		m_TagBits |= (std::uint64_t)1 << id;
+	else
+		m_Tags.insert(tag);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-EnvironmentResult::EnvironmentResult(Environment* env) :
-	m_Environment(env)
+const std::uint32_t BinaryResultWriter::MAGIC;
+const std::uint32_t BinaryResultWriter::VERSION;
+
+BinaryResultWriter::BinaryResultWriter()
 {}
 
-void EnvironmentResult::AddResult(const SuiteResult& result)
+BinaryResultWriter::~BinaryResultWriter()
 {
-	m_Results.push_back(result);
-	ResultObject::AddResult(result.GetTotalResult());
+	Close();
 }
 
-size_t EnvironmentResult::GetResultCount() const
+bool BinaryResultWriter::Open(const std::string& path)
 {
-	return m_Results.size();
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_File.open(path, std::ios::binary | std::ios::trunc);
+	if(!m_File)
+		return false;
+
+	Write32(MAGIC);
+	Write32(VERSION);
+	return true;
 }
 
-const SuiteResult& EnvironmentResult::GetResult(size_t i) const
+void BinaryResultWriter::WriteSuiteResult(const SuiteResult& result)
 {
-	return m_Results[i];
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if(!m_File.is_open())
+		return;
+
+	Write8(1);
+	Write32(InternString(result.GetSuite().GetInfo().GetName()));
+	Write8((std::uint8_t)result.GetTotalResult());
+	Write32((std::uint32_t)result.GetResultCount());
+
+	for(size_t i = 0; i < result.GetResultCount(); ++i) {
+		const TestResult& test = result.GetResult(i);
+		Write8(2);
+		Write32(InternString(test.GetTest().GetInfo().GetName()));
+		Write8((std::uint8_t)test.GetTotalResult());
+		WriteDouble(test.GetMilliseconds());
+		Write32((std::uint32_t)test.GetPassedCheckCount());
+		Write32((std::uint32_t)test.GetAssertCount());
+
+		for(size_t j = 0; j < test.GetAssertCount(); ++j) {
+			const AssertResult& assert = test.GetAssert(j);
+			Write32(InternString(assert.message));
+			Write8((std::uint8_t)assert.GetTotalResult());
+			Write32((std::uint32_t)assert.info.GetLine());
+		}
+	}
 }
 
-const SuiteResult& EnvironmentResult::GetResult(const std::string& name) const
+void BinaryResultWriter::WriteSuiteRecord(const BinaryResultReader::SuiteRecord& record)
 {
-	for(auto it = m_Results.begin(); it != m_Results.end(); ++it) {
-		if(it->GetSuite().GetInfo().GetName() == name) {
-			return *it;
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if(!m_File.is_open())
+		return;
+
+	Write8(1);
+	Write32(InternString(record.name));
+	Write8((std::uint8_t)record.result);
+	Write32((std::uint32_t)record.tests.size());
+
+	for(auto test = record.tests.begin(); test != record.tests.end(); ++test) {
+		Write8(2);
+		Write32(InternString(test->name));
+		Write8((std::uint8_t)test->result);
+		WriteDouble(test->milliseconds);
+		Write32((std::uint32_t)test->passedChecks);
+		Write32((std::uint32_t)test->asserts.size());
+
+		for(auto assert = test->asserts.begin(); assert != test->asserts.end(); ++assert) {
+			Write32(InternString(assert->message));
+			Write8((std::uint8_t)assert->result);
+			Write32((std::uint32_t)assert->line);
 		}
 	}
-
-	static SuiteResult NULL_Result(nullptr);
-	return NULL_Result;
 }
 
-const Environment& EnvironmentResult::GetEnvironment() const
+void BinaryResultWriter::Close()
 {
-	return *m_Environment;
-}
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if(!m_File.is_open())
+		return;
+
+	std::uint64_t tableOffset = (std::uint64_t)m_File.tellp();
+	Write8(0xFF);
+	Write32((std::uint32_t)m_Strings.size());
+	for(auto it = m_Strings.begin(); it != m_Strings.end(); ++it) {
+		Write32((std::uint32_t)it->size());
+		m_File.write(it->data(), it->size());
+	}
 
-///////////////////////////////////////////////////////////////////////////////
+	Write64(tableOffset);
+	Write32(MAGIC);
 
-Environment::Environment() :
-	m_Callback(nullptr)
-{}
+	m_File.close();
+	m_StringIds.clear();
+	m_Strings.clear();
+}
 
-Environment& Environment::Instance()
+std::uint32_t BinaryResultWriter::InternString(const std::string& str)
 {
-	static Environment theInstance;
-	return theInstance;
+	auto it = m_StringIds.find(str);
+	if(it != m_StringIds.end())
+		return it->second;
+
+	std::uint32_t id = (std::uint32_t)m_Strings.size();
+	m_StringIds.emplace(str, id);
+	m_Strings.push_back(str);
+	return id;
 }
 
-void Environment::SetControl(ControlCallback* control)
+void BinaryResultWriter::Write8(std::uint8_t value)
 {
-	m_Callback = control;
+	m_File.write((const char*)&value, sizeof(value));
 }
 
-ControlCallback* Environment::GetControl() const
+void BinaryResultWriter::Write32(std::uint32_t value)
 {
-	return m_Callback;
+	m_File.write((const char*)&value, sizeof(value));
 }
 
-void Environment::AddFilter(Filter* filter)
+void BinaryResultWriter::Write64(std::uint64_t value)
 {
-	m_Filter.push_back(filter);
+	m_File.write((const char*)&value, sizeof(value));
 }
 
-void Environment::RemoveFilter(Filter* filter)
+void BinaryResultWriter::WriteDouble(double value)
 {
-	for(auto it = m_Filter.begin(); it != m_Filter.end(); ++it) {
-		if(*it == filter) {
-			m_Filter.erase(it);
-			return;
-		}
-	}
+	m_File.write((const char*)&value, sizeof(value));
 }
 
-bool Environment::AllowSuite(const Suite* s) const
+///////////////////////////////////////////////////////////////////////////////
+
+bool BinaryResultReader::Open(const std::string& path)
 {
-	for(auto it = m_Filter.begin(); it != m_Filter.end(); ++it) {
-		if(!(*it)->IsOK(*s))
+	std::ifstream file(path, std::ios::binary);
+	if(!file)
+		return false;
+
+	std::uint32_t magic;
+	std::uint32_t version;
+	if(!Read32(file, magic) || magic != BinaryResultWriter::MAGIC)
+		return false;
+	if(!Read32(file, version) || version != BinaryResultWriter::VERSION)
+		return false;
+
+	file.seekg(-(std::streamoff)(sizeof(std::uint64_t) + sizeof(std::uint32_t)),
+			std::ios::end);
+	std::uint64_t tableOffset;
+	std::uint32_t endMagic;
+	if(!Read64(file, tableOffset) || !Read32(file, endMagic) ||
+			endMagic != BinaryResultWriter::MAGIC)
+		return false;
+
+	file.seekg((std::streamoff)tableOffset, std::ios::beg);
+	std::uint8_t type;
+	std::uint32_t stringCount;
+	if(!Read8(file, type) || type != 0xFF || !Read32(file, stringCount))
+		return false;
+
+	std::vector<std::string> strings(stringCount);
+	for(std::uint32_t i = 0; i < stringCount; ++i) {
+		std::uint32_t length;
+		if(!Read32(file, length))
+			return false;
+		strings[i].resize(length);
+		if(length && !file.read(&strings[i][0], length))
+			return false;
+	}
+
+	file.clear();
+	file.seekg(2 * sizeof(std::uint32_t), std::ios::beg);
+
+	m_Suites.clear();
+	while((std::uint64_t)file.tellg() < tableOffset) {
+		std::uint32_t nameId;
+		std::uint8_t result;
+		std::uint32_t testCount;
+		if(!Read8(file, type) || type != 1)
+			return false;
+		if(!Read32(file, nameId) || nameId >= stringCount)
 			return false;
+		if(!Read8(file, result) || !Read32(file, testCount))
+			return false;
+
+		SuiteRecord suite;
+		suite.name = strings[nameId];
+		suite.result = (Result)result;
+		suite.tests.resize(testCount);
+
+		for(std::uint32_t i = 0; i < testCount; ++i) {
+			std::uint32_t passedChecks;
+			std::uint32_t assertCount;
+			if(!Read8(file, type) || type != 2)
+				return false;
+			if(!Read32(file, nameId) || nameId >= stringCount)
+				return false;
+			TestRecord& test = suite.tests[i];
+			test.name = strings[nameId];
+			if(!Read8(file, result))
+				return false;
+			test.result = (Result)result;
+			if(!ReadDouble(file, test.milliseconds))
+				return false;
+			if(!Read32(file, passedChecks) || !Read32(file, assertCount))
+				return false;
+			test.passedChecks = passedChecks;
+			test.asserts.resize(assertCount);
+
+			for(std::uint32_t j = 0; j < assertCount; ++j) {
+				std::uint32_t line;
+				if(!Read32(file, nameId) || nameId >= stringCount)
+					return false;
+				AssertRecord& assert = test.asserts[j];
+				assert.message = strings[nameId];
+				if(!Read8(file, result) || !Read32(file, line))
+					return false;
+				assert.result = (Result)result;
+				assert.line = (int)line;
+			}
+		}
+
+		m_Suites.push_back(std::move(suite));
 	}
 
 	return true;
 }
 
-size_t Environment::GetSuiteCount() const
+size_t BinaryResultReader::GetSuiteCount() const
 {
 	return m_Suites.size();
 }
 
-const Suite& Environment::GetSuite(size_t i) const
+const BinaryResultReader::SuiteRecord& BinaryResultReader::GetSuite(size_t i) const
 {
-	return *m_Suites[i];
+	return m_Suites[i];
 }
 
-void Environment::RegisterSuite(Suite* suite)
+bool MergeBinaryResults(const std::vector<std::string>& inputFiles,
+		const std::string& outputFile)
 {
-	m_SuiteMap.emplace(suite->GetInfo().GetName(), m_Suites.size());
-	m_Suites.push_back(suite);
-}
+	BinaryResultWriter writer;
+	if(!writer.Open(outputFile))
+		return false;
 
-bool Environment::CheckDependencies(const Suite* s,
-		EnvironmentResult& result, bool& Procceed,
-		const std::vector<size_t>& resultConnector)
-{
-	for(size_t i = 0; i != s->GetDependencyCount(); ++i){
-		size_t suiteID = m_SuiteMap[s->GetDependency(i)];
-		size_t resultID = resultConnector[suiteID];
-		const SuiteResult& suiteRes = result.GetResult(resultID);
-		if(suiteRes.GetTotalResult() != Result::Success) {
-			ControlAction action = GetControl()->OnDependencyFail(
-					*s, suiteRes.GetSuite(), suiteRes);
-			if(action == ControlAction::Ignore) {
-				(void)0;
-			} else if(action == ControlAction::AbortCurrent) {
-				Procceed = true;
-				return false;
-			} else {
-				Procceed = false;
-				return false;
-			}
-		}
+	for(auto it = inputFiles.begin(); it != inputFiles.end(); ++it) {
+		BinaryResultReader reader;
+		if(!reader.Open(*it))
+			return false;
+		for(size_t i = 0; i < reader.GetSuiteCount(); ++i)
+			writer.WriteSuiteRecord(reader.GetSuite(i));
 	}
 
+	writer.Close();
 	return true;
 }
 
-bool Environment::RunSuites(const std::vector<Suite*>& suites,
-		EnvironmentResult& result)
+bool BinaryResultReader::Read8(std::istream& file, std::uint8_t& value)
 {
-	std::vector<size_t> resultConnector(m_Suites.size());
+	return (bool)file.read((char*)&value, sizeof(value));
+}
 
-	for(auto it= suites.begin(); it != suites.end(); ++it) {
-		bool procceed = true;
+bool BinaryResultReader::Read32(std::istream& file, std::uint32_t& value)
+{
+	return (bool)file.read((char*)&value, sizeof(value));
+}
 
-		SuiteResult suiteResult(*it);
-		GetControl()->OnSuiteBegin(**it);
+bool BinaryResultReader::Read64(std::istream& file, std::uint64_t& value)
+{
+	return (bool)file.read((char*)&value, sizeof(value));
+}
 
-		if(CheckDependencies(*it, result, procceed, resultConnector)) {
-			if(!(*it)->Run(suiteResult))
-				procceed = false;
-		} else {
-			suiteResult.SetTotalResult(Result::Unknown);
-		}
+bool BinaryResultReader::ReadDouble(std::istream& file, double& value)
+{
+	return (bool)file.read((char*)&value, sizeof(value));
+}
 
-		GetControl()->OnSuiteEnd(suiteResult);
-		
-		size_t suiteID = m_SuiteMap[(*it)->GetInfo().GetName()];
-		size_t resultID = result.GetResultCount();
-		resultConnector[suiteID] = resultID;
+///////////////////////////////////////////////////////////////////////////////
 
-		result.AddResult(suiteResult);
+TaskGroup::TaskGroup() :
+	m_Pending(0)
+{}
 
-		if(!procceed)
-			return false;
-	}
+///////////////////////////////////////////////////////////////////////////////
 
-	return true;
-}
+WorkerPool::WorkerPool() :
+	m_Running(0),
+	m_Shutdown(false)
+{}
 
-int Environment::TopoVisit(size_t cur, std::vector<Suite*>& result,
-		std::vector<std::pair<bool, bool>>& mark,
-		std::vector<const Suite*>& unsolvable)
+WorkerPool::~WorkerPool()
 {
-	if(mark[cur].second)
-		return 1;
+	Stop();
+}
 
-	if(mark[cur].first)
-		return 0;
+void WorkerPool::Start(size_t threadCount)
+{
+	Stop();
 
-	mark[cur].second = true;
-	for(size_t j = 0; j < m_Suites[cur]->GetDependencyCount(); ++j) {
-		if(!mark[cur].first) {
-			const std::string& depName = m_Suites[cur]->GetDependency(j);
-			auto dep = m_SuiteMap.find(depName);
-			if(dep == m_SuiteMap.end()) {
-				ControlAction action = GetControl()->OnUnknownDependency(
-						*m_Suites[cur], depName);
-				if(action == ControlAction::Ignore)
-					(void)0;
-				else
-					return 2;
-			}
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Shutdown = false;
+	for(size_t i = 0; i < threadCount; ++i)
+		m_Threads.push_back(std::thread(&WorkerPool::WorkerMain, this));
+}
 
-			int visitResult = TopoVisit(dep->second, result, mark, unsolvable);
-			if(visitResult) {
-				if(visitResult == 1)
-					unsolvable.push_back(m_Suites[dep->second]);
-				return visitResult;
-			}
-		}
+void WorkerPool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Shutdown = true;
 	}
+	m_TaskAvailable.notify_all();
 
-	mark[cur].first = true;
-	mark[cur].second = false;
-	result.push_back(m_Suites[cur]);
+	for(auto it = m_Threads.begin(); it != m_Threads.end(); ++it)
+		it->join();
+	m_Threads.clear();
+}
 
-	return 0;
+size_t WorkerPool::GetThreadCount() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	return m_Threads.size();
 }
 
-bool Environment::SolveDependencies(std::vector<Suite*>& result)
+void WorkerPool::Push(std::function<void()> task)
 {
-	std::vector<std::pair<bool, bool>> mark(m_Suites.size(),
-			std::pair<bool,bool>(false, false));
-	std::vector<const Suite*> unsolvable;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Tasks.push_back(Task{nullptr, std::move(task)});
+	}
+	m_TaskAvailable.notify_one();
+}
 
-	bool succeded = true;
-	for(size_t i = 0; i < m_Suites.size(); ++i) {
-		if(!mark[i].first && AllowSuite(m_Suites[i])) {
-			succeded = (TopoVisit(i, result, mark, unsolvable) == 0);
-			if(!succeded)
-				break;
+void WorkerPool::Push(TaskGroup& group, std::function<void()> task)
+{
+	group.m_Pending.fetch_add(1);
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Tasks.push_back(Task{&group, std::move(task)});
+	}
+	m_TaskAvailable.notify_one();
+}
+
+void WorkerPool::WaitIdle()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_Idle.wait(lock, [this]() {
+		return (m_Tasks.empty() && m_Running == 0);
+	});
+}
+
+void WorkerPool::WaitGroup(TaskGroup& group)
+{
+	// The waiting thread executes queued tasks itself instead of just
+	// blocking, so a task may wait for subtasks it pushed onto the same
+	// pool without deadlocking.
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	while(group.m_Pending.load() != 0) {
+		if(!m_Tasks.empty()) {
+			Task task = std::move(m_Tasks.front());
+			m_Tasks.pop_front();
+			ExecuteTask(lock, std::move(task));
+		} else {
+			m_TaskDone.wait(lock, [this, &group]() {
+				return (group.m_Pending.load() == 0 || !m_Tasks.empty());
+			});
 		}
 	}
+}
 
-	if(!succeded) {
-		result.clear();
-		if(!unsolvable.empty())
-			GetControl()->OnUnsolvableDependencies(*this, unsolvable);
+void WorkerPool::WorkerMain()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	while(true) {
+		m_TaskAvailable.wait(lock, [this]() {
+			return (m_Shutdown || !m_Tasks.empty());
+		});
+
+		if(m_Shutdown && m_Tasks.empty())
+			return;
+
+		Task task = std::move(m_Tasks.front());
+		m_Tasks.pop_front();
+		ExecuteTask(lock, std::move(task));
 	}
+}
 
-	return succeded;
+void WorkerPool::ExecuteTask(std::unique_lock<std::mutex>& lock, Task task)
+{
+	++m_Running;
+	lock.unlock();
+
+	task.func();
+
+	lock.lock();
+	--m_Running;
+	if(task.group)
+		task.group->m_Pending.fetch_sub(1);
+	m_TaskDone.notify_all();
+	if(m_Tasks.empty() && m_Running == 0)
+		m_Idle.notify_all();
 }
 
-void Environment::Run()
+///////////////////////////////////////////////////////////////////////////////
+
+AsyncReporter::AsyncReporter() :
+	m_Callback(nullptr),
+	m_CallbackMutex(nullptr),
+	m_Pending(nullptr),
+	m_Running(false)
+{}
+
+AsyncReporter::~AsyncReporter()
 {
-	ConsoleCallback fallbackCallback;
+	Stop();
+}
 
-	if(!m_Callback)
-		m_Callback = &fallbackCallback;
+void AsyncReporter::Start(ControlCallback* callback,
+		std::mutex* callbackMutex)
+{
+	if(m_Running.load())
+		return;
 
-	EnvironmentResult result(this);
-	std::vector<Suite*> performSuites;
+	m_Callback = callback;
+	m_CallbackMutex = callbackMutex;
+	m_Running.store(true);
+	m_Thread = std::thread(&AsyncReporter::ReporterMain, this);
+}
 
-	if(SolveDependencies(performSuites)) {
-		GetControl()->OnBegin(*this);
-		RunSuites(performSuites, result);
-		GetControl()->OnEnd(result);
-	}
+void AsyncReporter::Stop()
+{
+	if(!m_Thread.joinable())
+		return;
+
+	// The reporter thread only exits once the queue is empty, so every
+	// event pushed before Stop is dispatched.
+	m_Running.store(false);
+	m_Thread.join();
+	m_Callback = nullptr;
+	m_CallbackMutex = nullptr;
+}
 
-	if(m_Callback == &fallbackCallback)
-		m_Callback = nullptr;
+bool AsyncReporter::IsRunning() const
+{
+	return m_Running.load(std::memory_order_relaxed);
+}
+
+void AsyncReporter::Push(Event* event)
+{
+	Event* head = m_Pending.load(std::memory_order_relaxed);
+	do {
+		event->next = head;
+	} while(!m_Pending.compare_exchange_weak(head, event,
+			std::memory_order_release, std::memory_order_relaxed));
+}
+
+void AsyncReporter::ReporterMain()
+{
+	while(true) {
+		Event* head = m_Pending.exchange(nullptr, std::memory_order_acquire);
+		if(!head) {
+			if(!m_Running.load(std::memory_order_acquire))
+				return;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		// Producers push onto a stack, so the grabbed list is newest
+		// first; reverse it to dispatch in submission order.
+		Event* ordered = nullptr;
+		while(head) {
+			Event* next = head->next;
+			head->next = ordered;
+			ordered = head;
+			head = next;
+		}
+		while(ordered) {
+			Event* next = ordered->next;
+			{
+				// Decision hooks (OnException, dependency failures) run
+				// synchronously on test threads under this mutex, so
+				// locking per event keeps the callback single-threaded
+				// without stalling them for a whole batch.
+				std::lock_guard<std::mutex> lock(*m_CallbackMutex);
+				ordered->Dispatch(m_Callback);
+			}
+			delete ordered;
+			ordered = next;
+		}
+	}
 }
 
-}
\ No newline at end of file
+void AsyncReporter::PushTestBegin(Test* test)
+{
+	struct TestBeginEvent : Event
+	{
+		Test* test;
+		virtual void Dispatch(ControlCallback* callback)
+		{
+			callback->OnTestBegin(*test);
+		}
+	};
+	TestBeginEvent* event = new TestBeginEvent;
+	event->test = test;
+	Push(event);
+}
+
+void AsyncReporter::PushTestEnd(const TestResult& result)
+{
+	struct TestEndEvent : Event
+	{
+		TestEndEvent(const TestResult& r) : result(r) {}
+		TestResult result;
+		virtual void Dispatch(ControlCallback* callback)
+		{
+			callback->OnTestEnd(result);
+		}
+	};
+	Push(new TestEndEvent(result));
+}
+
+void AsyncReporter::PushAssert(const AssertResult& result)
+{
+	struct AssertEvent : Event
+	{
+		AssertEvent(const AssertResult& r) : result(r) {}
+		AssertResult result;
+		virtual void Dispatch(ControlCallback* callback)
+		{
+			callback->OnAssert(result);
+		}
+	};
+	Push(new AssertEvent(result));
+}
+
+void AsyncReporter::PushSuiteBegin(Suite* suite)
+{
+	struct SuiteBeginEvent : Event
+	{
+		Suite* suite;
+		virtual void Dispatch(ControlCallback* callback)
+		{
+			callback->OnSuiteBegin(*suite);
+		}
+	};
+	SuiteBeginEvent* event = new SuiteBeginEvent;
+	event->suite = suite;
+	Push(event);
+}
+
+void AsyncReporter::PushSuiteEnd(const SuiteResult& result)
+{
+	struct SuiteEndEvent : Event
+	{
+		SuiteEndEvent(const SuiteResult& r) : result(r) {}
+		SuiteResult result;
+		virtual void Dispatch(ControlCallback* callback)
+		{
+			callback->OnSuiteEnd(result);
+		}
+	};
+	Push(new SuiteEndEvent(result));
+}
+
+void AsyncReporter::PushTimeRegression(const TestResult& result,
+		double baselineMilliseconds)
+{
+	struct TimeRegressionEvent : Event
+	{
+		TimeRegressionEvent(const TestResult& r, double b) :
+			result(r), baseline(b)
+		{}
+		TestResult result;
+		double baseline;
+		virtual void Dispatch(ControlCallback* callback)
+		{
+			callback->OnTimeRegression(result, baseline);
+		}
+	};
+	Push(new TimeRegressionEvent(result, baselineMilliseconds));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+EnvironmentResult::EnvironmentResult(Environment* env) :
+	m_Environment(env),
+	m_Milliseconds(0),
+	m_FixtureMilliseconds(0)
+{}
+
+void EnvironmentResult::AddResult(const SuiteResult& result)
+{
+	m_ResultMap.emplace(result.GetSuite().GetInfo().GetName(), m_Results.size());
+	m_Results.push_back(result);
+	m_Milliseconds += result.GetMilliseconds();
+	m_FixtureMilliseconds += result.GetFixtureMilliseconds();
+	ResultObject::AddResult(result.GetTotalResult());
+}
+
+void EnvironmentResult::AddResult(SuiteResult&& result)
+{
+	m_ResultMap.emplace(result.GetSuite().GetInfo().GetName(), m_Results.size());
+	m_Milliseconds += result.GetMilliseconds();
+	m_FixtureMilliseconds += result.GetFixtureMilliseconds();
+	ResultObject::AddResult(result.GetTotalResult());
+	m_Results.push_back(std::move(result));
+}
+
+size_t EnvironmentResult::GetResultCount() const
+{
+	return m_Results.size();
+}
+
+const SuiteResult& EnvironmentResult::GetResult(size_t i) const
+{
+	return m_Results[i];
+}
+
+const SuiteResult& EnvironmentResult::GetResult(const std::string& name) const
+{
+	auto it = m_ResultMap.find(name);
+	if(it != m_ResultMap.end())
+		return m_Results[it->second];
+
+	static SuiteResult NULL_Result(nullptr);
+	return NULL_Result;
+}
+
+const Environment& EnvironmentResult::GetEnvironment() const
+{
+	return *m_Environment;
+}
+
+double EnvironmentResult::GetMilliseconds() const
+{
+	return m_Milliseconds;
+}
+
+double EnvironmentResult::GetFixtureMilliseconds() const
+{
+	return m_FixtureMilliseconds;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+Environment::Environment() :
+	m_Callback(nullptr),
+	m_ThreadCount(1),
+	m_Retention(ResultRetention::All),
+	m_ResultWriter(nullptr),
+	m_BaselineThreshold(1.5),
+	m_PerfCountersEnabled(false),
+	m_ProcessIsolation(false),
+	m_TestTimeout(0),
+	m_SuiteTimeout(0),
+	m_Fingerprint(nullptr),
+	m_Ordering(TestOrdering::Registration),
+	m_ShardIndex(0),
+	m_ShardCount(1),
+	m_AsyncReporting(false)
+{}
+
+Environment& Environment::Instance()
+{
+	static Environment theInstance;
+	return theInstance;
+}
+
+void Environment::SetControl(ControlCallback* control)
+{
+	m_Callback = control;
+}
+
+ControlCallback* Environment::GetControl() const
+{
+	return m_Callback;
+}
+
+void Environment::SetResultRetention(ResultRetention retention)
+{
+	m_Retention = retention;
+}
+
+ResultRetention Environment::GetResultRetention() const
+{
+	return m_Retention;
+}
+
+void Environment::SetBaselineFile(const std::string& path, double thresholdFactor)
+{
+	m_BaselineFile = path;
+	m_BaselineThreshold = thresholdFactor;
+}
+
+// strto* based so a corrupt cache or baselines file (e.g. a run killed
+// mid-save) skips the bad line instead of throwing out of the loader.
+static bool ParseInt(const std::string& str, int& out)
+{
+	if(str.empty())
+		return false;
+	char* end = nullptr;
+	long value = std::strtol(str.c_str(), &end, 10);
+	if(end != str.c_str() + str.size())
+		return false;
+	out = (int)value;
+	return true;
+}
+
+static bool ParseDouble(const std::string& str, double& out)
+{
+	if(str.empty())
+		return false;
+	char* end = nullptr;
+	out = std::strtod(str.c_str(), &end);
+	return end == str.c_str() + str.size();
+}
+
+void Environment::LoadBaselines()
+{
+	m_Baselines.clear();
+	if(m_BaselineFile.empty())
+		return;
+
+	std::ifstream file(m_BaselineFile);
+	std::string line;
+	while(std::getline(file, line)) {
+		size_t sep = line.find('\t');
+		if(sep == std::string::npos)
+			continue;
+		double millis;
+		if(!ParseDouble(line.substr(sep + 1), millis))
+			continue;
+		m_Baselines[line.substr(0, sep)] = millis;
+	}
+}
+
+void Environment::SaveBaselines(const EnvironmentResult& result)
+{
+	if(m_BaselineFile.empty())
+		return;
+
+	// Carry over entries of tests that did not run this time, so a
+	// filtered invocation does not wipe the baselines of everything else.
+	for(size_t i = 0; i < result.GetResultCount(); ++i) {
+		const SuiteResult& suiteRes = result.GetResult(i);
+		for(size_t j = 0; j < suiteRes.GetResultCount(); ++j) {
+			const TestResult& testRes = suiteRes.GetResult(j);
+			std::string key = suiteRes.GetSuite().GetInfo().GetName() +
+					"/" + testRes.GetTest().GetInfo().GetName();
+			m_Baselines[key] = testRes.GetMilliseconds();
+		}
+	}
+
+	std::ofstream file(m_BaselineFile, std::ios::trunc);
+	for(auto it = m_Baselines.begin(); it != m_Baselines.end(); ++it)
+		file << it->first << '\t' << it->second << '\n';
+}
+
+void Environment::CheckTimeRegression(const TestResult& result) const
+{
+	if(m_Baselines.empty())
+		return;
+
+	std::string key = result.GetTest().GetSuite().GetInfo().GetName() +
+			"/" + result.GetTest().GetInfo().GetName();
+	auto it = m_Baselines.find(key);
+	if(it == m_Baselines.end())
+		return;
+
+	if(result.GetMilliseconds() > it->second * m_BaselineThreshold) {
+		if(m_Reporter.IsRunning()) {
+			m_Reporter.PushTimeRegression(result, it->second);
+		} else {
+			std::lock_guard<std::mutex> lock(m_CallbackMutex);
+			GetControl()->OnTimeRegression(result, it->second);
+		}
+	}
+}
+
+void Environment::SetPerfCountersEnabled(bool enabled)
+{
+	m_PerfCountersEnabled = enabled;
+}
+
+bool Environment::GetPerfCountersEnabled() const
+{
+	return m_PerfCountersEnabled;
+}
+
+void Environment::SetResultCacheFile(const std::string& path)
+{
+	m_CacheFile = path;
+}
+
+void Environment::SetFingerprintFunction(FingerprintFunction func)
+{
+	m_Fingerprint = func;
+}
+
+void Environment::SetPlanCacheFile(const std::string& path)
+{
+	m_PlanCacheFile = path;
+}
+
+static std::string TestKey(const Test& test)
+{
+	return test.GetSuite().GetInfo().GetName() + "/" +
+			test.GetInfo().GetName();
+}
+
+void Environment::LoadResultCache()
+{
+	m_ResultCache.clear();
+	if(m_CacheFile.empty())
+		return;
+
+	std::ifstream file(m_CacheFile);
+	std::string line;
+	while(std::getline(file, line)) {
+		size_t sep1 = line.find('\t');
+		if(sep1 == std::string::npos)
+			continue;
+		size_t sep2 = line.find('\t', sep1 + 1);
+		if(sep2 == std::string::npos)
+			continue;
+		size_t sep3 = line.find('\t', sep2 + 1);
+		if(sep3 == std::string::npos)
+			continue;
+
+		int result;
+		CachedTestResult entry;
+		if(!ParseInt(line.substr(sep2 + 1, sep3 - sep2 - 1), result))
+			continue;
+		if(result < (int)Result::Success || result > (int)Result::Timeout)
+			continue;
+		if(!ParseDouble(line.substr(sep3 + 1), entry.milliseconds))
+			continue;
+		entry.fingerprint = line.substr(sep1 + 1, sep2 - sep1 - 1);
+		entry.result = (Result)result;
+		m_ResultCache[line.substr(0, sep1)] = entry;
+	}
+}
+
+void Environment::SaveResultCache()
+{
+	if(m_CacheFile.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(m_CacheMutex);
+	std::ofstream file(m_CacheFile, std::ios::trunc);
+	for(auto it = m_ResultCache.begin(); it != m_ResultCache.end(); ++it) {
+		file << it->first << '\t' << it->second.fingerprint << '\t' <<
+				(int)it->second.result << '\t' <<
+				it->second.milliseconds << '\n';
+	}
+}
+
+bool Environment::TryReplayCachedResult(Test* test, TestResult& result) const
+{
+	if(m_CacheFile.empty() || !m_Fingerprint)
+		return false;
+
+	std::string fingerprint = m_Fingerprint(*test);
+	if(fingerprint.empty())
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_CacheMutex);
+	auto it = m_ResultCache.find(TestKey(*test));
+	if(it == m_ResultCache.end())
+		return false;
+	// Only successes are replayed; failed tests always rerun so their
+	// asserts are reproduced in full.
+	if(it->second.fingerprint != fingerprint ||
+			it->second.result != Result::Success)
+		return false;
+
+	result.SetTime(it->second.milliseconds);
+	return true;
+}
+
+void Environment::CacheTestResult(const TestResult& result) const
+{
+	if(m_CacheFile.empty())
+		return;
+
+	// Without a fingerprint function nothing is ever replayed, but the
+	// outcome and duration are still recorded for FailureFirst ordering.
+	CachedTestResult entry;
+	entry.fingerprint = m_Fingerprint ?
+			m_Fingerprint(result.GetTest()) : std::string();
+	entry.result = result.GetTotalResult();
+	entry.milliseconds = result.GetMilliseconds();
+
+	std::lock_guard<std::mutex> lock(m_CacheMutex);
+	m_ResultCache[TestKey(result.GetTest())] = entry;
+}
+
+bool Environment::GetCachedOutcome(const Test& test, Result& outcome,
+		double& milliseconds) const
+{
+	std::lock_guard<std::mutex> lock(m_CacheMutex);
+	auto it = m_ResultCache.find(TestKey(test));
+	if(it == m_ResultCache.end())
+		return false;
+	outcome = it->second.result;
+	milliseconds = it->second.milliseconds;
+	return true;
+}
+
+void Environment::RunCaseBatches(size_t caseCount, size_t batchSize,
+		const std::function<void(size_t, size_t)>& runBatch) const
+{
+	// Batching is only worth it once the pool is running and the range
+	// splits into at least two batches.
+	if(m_WorkerPool.GetThreadCount() == 0 || caseCount < batchSize * 2) {
+		if(caseCount)
+			runBatch(0, caseCount);
+		return;
+	}
+
+	TaskGroup group;
+	for(size_t first = 0; first < caseCount; first += batchSize) {
+		size_t batchCount = std::min(batchSize, caseCount - first);
+		m_WorkerPool.Push(group, [&runBatch, first, batchCount]() {
+			runBatch(first, batchCount);
+		});
+	}
+	m_WorkerPool.WaitGroup(group);
+}
+
+void Environment::SetAsyncReporting(bool enabled)
+{
+	m_AsyncReporting = enabled;
+}
+
+bool Environment::GetAsyncReporting() const
+{
+	return m_AsyncReporting;
+}
+
+void Environment::ReportAssert(AssertResult& result) const
+{
+	if(m_Reporter.IsRunning()) {
+		m_Reporter.PushAssert(result);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_CallbackMutex);
+	GetControl()->OnAssert(result);
+}
+
+void Environment::ReportTestBegin(Test& test) const
+{
+	if(m_Reporter.IsRunning()) {
+		m_Reporter.PushTestBegin(&test);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_CallbackMutex);
+	GetControl()->OnTestBegin(test);
+}
+
+bool Environment::ReportTestEnd(const TestResult& result) const
+{
+	if(m_Reporter.IsRunning()) {
+		// A repeat request cannot be honored asynchronously.
+		m_Reporter.PushTestEnd(result);
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(m_CallbackMutex);
+	return GetControl()->OnTestEnd(result);
+}
+
+void Environment::ReportSuiteBegin(Suite& suite) const
+{
+	if(m_Reporter.IsRunning()) {
+		m_Reporter.PushSuiteBegin(&suite);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_CallbackMutex);
+	GetControl()->OnSuiteBegin(suite);
+}
+
+void Environment::ReportSuiteEnd(const SuiteResult& result) const
+{
+	if(m_Reporter.IsRunning()) {
+		m_Reporter.PushSuiteEnd(result);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_CallbackMutex);
+	GetControl()->OnSuiteEnd(result);
+}
+
+void Environment::SetTestOrdering(TestOrdering ordering)
+{
+	m_Ordering = ordering;
+}
+
+TestOrdering Environment::GetTestOrdering() const
+{
+	return m_Ordering;
+}
+
+void Environment::SetTestTimeout(double milliseconds)
+{
+	m_TestTimeout = milliseconds;
+}
+
+double Environment::GetTestTimeout() const
+{
+	return m_TestTimeout;
+}
+
+void Environment::SetSuiteTimeout(double milliseconds)
+{
+	m_SuiteTimeout = milliseconds;
+}
+
+double Environment::GetSuiteTimeout() const
+{
+	return m_SuiteTimeout;
+}
+
+void Environment::SetProcessIsolation(bool enabled)
+{
+	m_ProcessIsolation = enabled;
+}
+
+bool Environment::GetProcessIsolation() const
+{
+	return m_ProcessIsolation;
+}
+
+void Environment::SetResultWriter(BinaryResultWriter* writer)
+{
+	m_ResultWriter = writer;
+}
+
+BinaryResultWriter* Environment::GetResultWriter() const
+{
+	return m_ResultWriter;
+}
+
+void Environment::SetThreadCount(size_t count)
+{
+	m_ThreadCount = (count > 0) ? count : 1;
+}
+
+size_t Environment::GetThreadCount() const
+{
+	return m_ThreadCount;
+}
+
+WorkerPool& Environment::GetWorkerPool() const
+{
+	return m_WorkerPool;
+}
+
+std::mutex& Environment::GetCallbackMutex() const
+{
+	return m_CallbackMutex;
+}
+
+void Environment::AddFilter(Filter* filter)
+{
+	m_Filter.push_back(filter);
+}
+
+void Environment::RemoveFilter(Filter* filter)
+{
+	for(auto it = m_Filter.begin(); it != m_Filter.end(); ++it) {
+		if(*it == filter) {
+			m_Filter.erase(it);
+			return;
+		}
+	}
+}
+
+bool TagExpression::Compile(const std::string& expression,
+		const Environment& env)
+{
+	m_Program.clear();
+	size_t pos = 0;
+	if(!ParseOr(expression, pos, env)) {
+		m_Program.clear();
+		return false;
+	}
+
+	while(pos < expression.size() && std::isspace((unsigned char)expression[pos]))
+		++pos;
+	if(pos != expression.size()) {
+		m_Program.clear();
+		return false;
+	}
+	return true;
+}
+
+bool TagExpression::IsEmpty() const
+{
+	return m_Program.empty();
+}
+
+bool TagExpression::Matches(const Suite& suite) const
+{
+	if(m_Program.empty())
+		return true;
+
+	// Postfix evaluation; expressions are tiny, so a small local stack
+	// covers them without touching the heap.
+	char stack[64];
+	size_t top = 0;
+	for(auto it = m_Program.begin(); it != m_Program.end(); ++it) {
+		switch(it->code) {
+		case OpCode::Tag:
+			if(top == sizeof(stack))
+				return false;
+			stack[top++] = it->mask ?
+					((suite.GetTagBits() & it->mask) != 0) :
+					suite.CheckTag(*it->tag);
+			break;
+		case OpCode::Not:
+			stack[top - 1] = !stack[top - 1];
+			break;
+		case OpCode::And:
+			stack[top - 2] = (stack[top - 2] && stack[top - 1]);
+			--top;
+			break;
+		case OpCode::Or:
+			stack[top - 2] = (stack[top - 2] || stack[top - 1]);
+			--top;
+			break;
+		}
+	}
+
+	return (stack[0] != 0);
+}
+
+static void SkipTagSpace(const std::string& s, size_t& pos)
+{
+	while(pos < s.size() && std::isspace((unsigned char)s[pos]))
+		++pos;
+}
+
+bool TagExpression::ParseOr(const std::string& s, size_t& pos,
+		const Environment& env)
+{
+	if(!ParseAnd(s, pos, env))
+		return false;
+
+	SkipTagSpace(s, pos);
+	while(pos < s.size() && s[pos] == '|') {
+		++pos;
+		if(!ParseAnd(s, pos, env))
+			return false;
+		m_Program.push_back({OpCode::Or, 0, nullptr});
+		SkipTagSpace(s, pos);
+	}
+	return true;
+}
+
+bool TagExpression::ParseAnd(const std::string& s, size_t& pos,
+		const Environment& env)
+{
+	if(!ParseUnary(s, pos, env))
+		return false;
+
+	SkipTagSpace(s, pos);
+	while(pos < s.size() && s[pos] == '&') {
+		++pos;
+		if(!ParseUnary(s, pos, env))
+			return false;
+		m_Program.push_back({OpCode::And, 0, nullptr});
+		SkipTagSpace(s, pos);
+	}
+	return true;
+}
+
+bool TagExpression::ParseUnary(const std::string& s, size_t& pos,
+		const Environment& env)
+{
+	SkipTagSpace(s, pos);
+	if(pos == s.size())
+		return false;
+
+	if(s[pos] == '!') {
+		++pos;
+		if(!ParseUnary(s, pos, env))
+			return false;
+		m_Program.push_back({OpCode::Not, 0, nullptr});
+		return true;
+	}
+
+	if(s[pos] == '(') {
+		++pos;
+		if(!ParseOr(s, pos, env))
+			return false;
+		SkipTagSpace(s, pos);
+		if(pos == s.size() || s[pos] != ')')
+			return false;
+		++pos;
+		return true;
+	}
+
+	size_t start = pos;
+	while(pos < s.size() && (std::isalnum((unsigned char)s[pos]) ||
+			s[pos] == '_' || s[pos] == '-' || s[pos] == '.'))
+		++pos;
+	if(pos == start)
+		return false;
+
+	// Interning here keeps the tag's ID stable even if no suite uses it
+	// yet; such a tag simply matches no suite.
+	std::string tag = s.substr(start, pos - start);
+	size_t id = env.InternTag(tag);
+	Op op;
+	op.code = OpCode::Tag;
+	op.mask = (id < 64) ? ((std::uint64_t)1 << id) : 0;
+	op.tag = &StringPool::Instance().Intern(tag);
+	m_Program.push_back(op);
+	return true;
+}
+
+bool Environment::SetTagExpression(const std::string& expression)
+{
+	if(expression.empty()) {
+		m_TagExpression = TagExpression();
+		return true;
+	}
+	return m_TagExpression.Compile(expression, *this);
+}
+
+size_t Environment::InternTag(const std::string& tag) const
+{
+	std::lock_guard<std::mutex> lock(m_TagMutex);
+	auto it = m_TagIds.find(tag);
+	if(it != m_TagIds.end())
+		return it->second;
+
+	size_t id = m_TagIds.size();
+	m_TagIds.emplace(tag, id);
+	return id;
+}
+
+bool Environment::FindTag(const std::string& tag, size_t& id) const
+{
+	std::lock_guard<std::mutex> lock(m_TagMutex);
+	auto it = m_TagIds.find(tag);
+	if(it == m_TagIds.end())
+		return false;
+	id = it->second;
+	return true;
+}
+
+bool Environment::AllowSuite(const Suite* s) const
+{
+	if(!m_TagExpression.IsEmpty() && !m_TagExpression.Matches(*s))
+		return false;
+
+	for(auto it = m_Filter.begin(); it != m_Filter.end(); ++it) {
+		if(!(*it)->IsOK(*s))
+			return false;
+	}
+
+	return true;
+}
+
+size_t Environment::GetSuiteCount() const
+{
+	return m_Suites.size();
+}
+
+const Suite& Environment::GetSuite(size_t i) const
+{
+	return *m_Suites[i];
+}
+
+void Environment::RegisterSuite(Suite* suite)
+{
+	m_SuiteMap.emplace(suite->GetInfo().GetName(), m_Suites.size());
+	m_Suites.push_back(suite);
+}
+
+bool Environment::CheckDependencies(const Suite* s,
+		EnvironmentResult& result, bool& Procceed,
+		const std::vector<size_t>& resultConnector)
+{
+	for(size_t i = 0; i != s->GetDependencyCount(); ++i){
+		size_t suiteID = m_SuiteMap[s->GetDependency(i)];
+		size_t resultID = resultConnector[suiteID];
+		const SuiteResult& suiteRes = result.GetResult(resultID);
+		if(suiteRes.GetTotalResult() != Result::Success) {
+			ControlAction action;
+			{
+				// Even the serial path must exclude the async reporter's
+				// in-flight dispatches.
+				std::lock_guard<std::mutex> lock(m_CallbackMutex);
+				action = GetControl()->OnDependencyFail(
+						*s, suiteRes.GetSuite(), suiteRes);
+			}
+			if(action == ControlAction::Ignore) {
+				(void)0;
+			} else if(action == ControlAction::AbortCurrent) {
+				Procceed = true;
+				return false;
+			} else {
+				Procceed = false;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool Environment::RunSuites(const std::vector<Suite*>& suites,
+		EnvironmentResult& result)
+{
+	std::vector<size_t> resultConnector(m_Suites.size());
+
+	for(auto it= suites.begin(); it != suites.end(); ++it) {
+		bool procceed = true;
+
+		SuiteResult suiteResult(*it);
+		ReportSuiteBegin(**it);
+
+		if(CheckDependencies(*it, result, procceed, resultConnector)) {
+			if(!(*it)->Run(suiteResult))
+				procceed = false;
+		} else {
+			suiteResult.SetTotalResult(Result::Unknown);
+		}
+
+		ReportSuiteEnd(suiteResult);
+
+		if(m_ResultWriter)
+			m_ResultWriter->WriteSuiteResult(suiteResult);
+
+		size_t suiteID = m_SuiteMap[(*it)->GetInfo().GetName()];
+		size_t resultID = result.GetResultCount();
+		resultConnector[suiteID] = resultID;
+
+		result.AddResult(std::move(suiteResult));
+
+		if(!procceed)
+			return false;
+	}
+
+	return true;
+}
+
+bool Environment::CheckDependenciesParallel(const Suite* s,
+		const std::map<std::string, size_t>& order,
+		const std::vector<SuiteResult>& results, bool& Procceed)
+{
+	for(size_t i = 0; i != s->GetDependencyCount(); ++i) {
+		auto dep = order.find(s->GetDependency(i));
+		if(dep == order.end())
+			continue; // Unknown dependency, was already ignored while solving.
+
+		const SuiteResult& suiteRes = results[dep->second];
+		if(suiteRes.GetTotalResult() != Result::Success) {
+			ControlAction action;
+			{
+				std::lock_guard<std::mutex> lock(m_CallbackMutex);
+				action = GetControl()->OnDependencyFail(
+						*s, suiteRes.GetSuite(), suiteRes);
+			}
+			if(action == ControlAction::Ignore) {
+				(void)0;
+			} else if(action == ControlAction::AbortCurrent) {
+				Procceed = true;
+				return false;
+			} else {
+				Procceed = false;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool Environment::RunSuitesParallel(const std::vector<Suite*>& suites,
+		EnvironmentResult& result)
+{
+	// Schedule directly on the dependency DAG: a suite becomes runnable
+	// as soon as all of its dependencies have finished, so independent
+	// branches of the graph execute concurrently.
+	std::map<std::string, size_t> order;
+	for(size_t i = 0; i < suites.size(); ++i)
+		order[suites[i]->GetInfo().GetName()] = i;
+
+	std::vector<SuiteResult> suiteResults;
+	suiteResults.reserve(suites.size());
+	std::vector<size_t> pending(suites.size(), 0);
+	std::vector<std::vector<size_t>> dependents(suites.size());
+	for(size_t i = 0; i < suites.size(); ++i) {
+		suiteResults.push_back(SuiteResult(suites[i]));
+		for(size_t j = 0; j < suites[i]->GetDependencyCount(); ++j) {
+			auto dep = order.find(suites[i]->GetDependency(j));
+			if(dep == order.end())
+				continue;
+			++pending[i];
+			dependents[dep->second].push_back(i);
+		}
+	}
+
+	TaskGroup group;
+	std::mutex scheduleMutex;
+	std::atomic<bool> procceed(true);
+	std::vector<char> ran(suites.size(), 0);
+
+	std::function<void(size_t)> runSuite;
+	runSuite = [&](size_t id) {
+		if(!procceed)
+			return;
+
+		Suite* suite = suites[id];
+		bool localProcceed = true;
+
+		ReportSuiteBegin(*suite);
+
+		if(CheckDependenciesParallel(suite, order, suiteResults, localProcceed)) {
+			if(!suite->Run(suiteResults[id]))
+				localProcceed = false;
+		} else {
+			suiteResults[id].SetTotalResult(Result::Unknown);
+		}
+
+		ReportSuiteEnd(suiteResults[id]);
+
+		if(m_ResultWriter)
+			m_ResultWriter->WriteSuiteResult(suiteResults[id]);
+
+		ran[id] = 1;
+
+		if(!localProcceed) {
+			procceed = false;
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(scheduleMutex);
+		for(auto it = dependents[id].begin(); it != dependents[id].end(); ++it) {
+			size_t d = *it;
+			if(--pending[d] == 0)
+				m_WorkerPool.Push(group, [&runSuite, d]() { runSuite(d); });
+		}
+	};
+
+	{
+		std::lock_guard<std::mutex> lock(scheduleMutex);
+		for(size_t i = 0; i < suites.size(); ++i) {
+			if(pending[i] == 0)
+				m_WorkerPool.Push(group, [&runSuite, i]() { runSuite(i); });
+		}
+	}
+
+	m_WorkerPool.WaitGroup(group);
+
+	for(size_t i = 0; i < suites.size(); ++i) {
+		if(ran[i])
+			result.AddResult(std::move(suiteResults[i]));
+	}
+
+	return procceed;
+}
+
+#ifndef _WIN32
+///////////////////////////////////////////////////////////////////////////////
+// Preforked process isolation.
+
+static bool ReadAllFd(int fd, void* buffer, size_t size)
+{
+	char* cur = (char*)buffer;
+	while(size) {
+		ssize_t got = read(fd, cur, size);
+		if(got <= 0)
+			return false;
+		cur += got;
+		size -= (size_t)got;
+	}
+
+	return true;
+}
+
+static bool WriteAllFd(int fd, const void* buffer, size_t size)
+{
+	const char* cur = (const char*)buffer;
+	while(size) {
+		ssize_t put = write(fd, cur, size);
+		if(put <= 0)
+			return false;
+		cur += put;
+		size -= (size_t)put;
+	}
+
+	return true;
+}
+
+static void Append8(std::string& blob, std::uint8_t value)
+{
+	blob.append((const char*)&value, sizeof(value));
+}
+
+static void Append32(std::string& blob, std::uint32_t value)
+{
+	blob.append((const char*)&value, sizeof(value));
+}
+
+static void AppendDouble(std::string& blob, double value)
+{
+	blob.append((const char*)&value, sizeof(value));
+}
+
+static void AppendString(std::string& blob, const std::string& str)
+{
+	Append32(blob, (std::uint32_t)str.size());
+	blob.append(str);
+}
+
+static bool Take(const std::string& blob, size_t& cursor, void* out, size_t size)
+{
+	if(cursor + size > blob.size())
+		return false;
+	std::copy(blob.begin() + cursor, blob.begin() + cursor + size, (char*)out);
+	cursor += size;
+	return true;
+}
+
+static bool TakeString(const std::string& blob, size_t& cursor, std::string& out)
+{
+	std::uint32_t size;
+	if(!Take(blob, cursor, &size, sizeof(size)))
+		return false;
+	if(cursor + size > blob.size())
+		return false;
+	out.assign(blob, cursor, size);
+	cursor += size;
+	return true;
+}
+
+static std::string SerializeSuiteResult(const SuiteResult& result)
+{
+	std::string blob;
+	Append8(blob, (std::uint8_t)result.GetTotalResult());
+	AppendDouble(blob, result.GetFixtureMilliseconds());
+	Append32(blob, (std::uint32_t)result.GetResultCount());
+
+	for(size_t i = 0; i < result.GetResultCount(); ++i) {
+		const TestResult& test = result.GetResult(i);
+		AppendString(blob, test.GetTest().GetInfo().GetName());
+		Append8(blob, (std::uint8_t)test.GetTotalResult());
+		AppendDouble(blob, test.GetMilliseconds());
+		Append32(blob, (std::uint32_t)test.GetPassedCheckCount());
+		Append32(blob, (std::uint32_t)test.GetAssertCount());
+
+		for(size_t j = 0; j < test.GetAssertCount(); ++j) {
+			const AssertResult& assert = test.GetAssert(j);
+			Append8(blob, (std::uint8_t)assert.GetTotalResult());
+			Append32(blob, (std::uint32_t)assert.info.GetLine());
+			AppendString(blob, assert.message);
+		}
+	}
+
+	return blob;
+}
+
+static bool DeserializeSuiteResult(const std::string& blob, Suite* suite,
+		SuiteResult& result)
+{
+	std::unordered_map<std::string, Test*> testMap;
+	for(size_t i = 0; i < suite->GetTestCount(); ++i) {
+		Test* test = const_cast<Test*>(&suite->GetTest((int)i));
+		testMap.emplace(test->GetInfo().GetName(), test);
+	}
+
+	size_t cursor = 0;
+	std::uint8_t totalResult;
+	double fixtureMillis;
+	std::uint32_t testCount;
+	if(!Take(blob, cursor, &totalResult, sizeof(totalResult)))
+		return false;
+	if(!Take(blob, cursor, &fixtureMillis, sizeof(fixtureMillis)))
+		return false;
+	if(!Take(blob, cursor, &testCount, sizeof(testCount)))
+		return false;
+	result.AddFixtureTime(fixtureMillis);
+
+	for(std::uint32_t i = 0; i < testCount; ++i) {
+		std::string name;
+		std::uint8_t testTotal;
+		double millis;
+		std::uint32_t passedChecks;
+		std::uint32_t assertCount;
+		if(!TakeString(blob, cursor, name))
+			return false;
+		if(!Take(blob, cursor, &testTotal, sizeof(testTotal)))
+			return false;
+		if(!Take(blob, cursor, &millis, sizeof(millis)))
+			return false;
+		if(!Take(blob, cursor, &passedChecks, sizeof(passedChecks)))
+			return false;
+		if(!Take(blob, cursor, &assertCount, sizeof(assertCount)))
+			return false;
+
+		// A name the suite doesn't know means the worker's output is
+		// corrupt; fail the blob like any other malformed field instead
+		// of building a result around a null test.
+		auto testIt = testMap.find(name);
+		if(testIt == testMap.end())
+			return false;
+		TestResult testResult(testIt->second);
+		testResult.SetTime(millis);
+		testResult.SetPassedCheckCount(passedChecks);
+
+		for(std::uint32_t j = 0; j < assertCount; ++j) {
+			std::uint8_t assertTotal;
+			std::uint32_t line;
+			std::string message;
+			if(!Take(blob, cursor, &assertTotal, sizeof(assertTotal)))
+				return false;
+			if(!Take(blob, cursor, &line, sizeof(line)))
+				return false;
+			if(!TakeString(blob, cursor, message))
+				return false;
+
+			testResult.AddResult(AssertResult(Info("", "", (int)line),
+					(Result)assertTotal, message));
+		}
+
+		result.AddResult(std::move(testResult));
+	}
+
+	result.SetTotalResult((Result)totalResult);
+	return true;
+}
+
+void Environment::IsolationWorkerMain(int readFd, int writeFd,
+		const std::vector<Suite*>& suites)
+{
+	while(true) {
+		std::int32_t index;
+		if(!ReadAllFd(readFd, &index, sizeof(index)) || index < 0)
+			break;
+
+		Suite* suite = suites[index];
+		SuiteResult suiteResult(suite);
+		GetControl()->OnSuiteBegin(*suite);
+		suite->Run(suiteResult);
+		GetControl()->OnSuiteEnd(suiteResult);
+
+		std::string blob = SerializeSuiteResult(suiteResult);
+		std::uint32_t size = (std::uint32_t)blob.size();
+		if(!WriteAllFd(writeFd, &size, sizeof(size)) ||
+				!WriteAllFd(writeFd, blob.data(), blob.size()))
+			break;
+	}
+
+	std::cout.flush();
+}
+
+bool Environment::RunSuitesIsolated(const std::vector<Suite*>& suites,
+		EnvironmentResult& result)
+{
+	// Writing into a pipe of a crashed worker must not kill the parent.
+	signal(SIGPIPE, SIG_IGN);
+
+	std::map<std::string, size_t> order;
+	for(size_t i = 0; i < suites.size(); ++i)
+		order[suites[i]->GetInfo().GetName()] = i;
+
+	std::vector<SuiteResult> suiteResults;
+	suiteResults.reserve(suites.size());
+	std::vector<size_t> pending(suites.size(), 0);
+	std::vector<std::vector<size_t>> dependents(suites.size());
+	for(size_t i = 0; i < suites.size(); ++i) {
+		suiteResults.push_back(SuiteResult(suites[i]));
+		for(size_t j = 0; j < suites[i]->GetDependencyCount(); ++j) {
+			auto dep = order.find(suites[i]->GetDependency(j));
+			if(dep == order.end())
+				continue;
+			++pending[i];
+			dependents[dep->second].push_back(i);
+		}
+	}
+
+	std::deque<size_t> ready;
+	for(size_t i = 0; i < suites.size(); ++i) {
+		if(pending[i] == 0)
+			ready.push_back(i);
+	}
+
+	auto releaseDependents = [&](size_t idx) {
+		for(auto it = dependents[idx].begin(); it != dependents[idx].end(); ++it) {
+			if(--pending[*it] == 0)
+				ready.push_back(*it);
+		}
+	};
+
+	// Fork the workers once, after all static registration has happened,
+	// so the per-process startup cost is paid workerCount times and not
+	// once per suite.
+	struct IsolationWorker
+	{
+		pid_t pid;
+		int toChild;
+		int fromChild;
+		std::int32_t current;
+		bool alive;
+	};
+
+	size_t workerCount = m_ThreadCount > 0 ? m_ThreadCount : 1;
+	if(workerCount > suites.size() && !suites.empty())
+		workerCount = suites.size();
+
+	std::vector<IsolationWorker> workers;
+	for(size_t i = 0; i < workerCount; ++i) {
+		int down[2];
+		int up[2];
+		if(pipe(down) != 0)
+			break;
+		if(pipe(up) != 0) {
+			close(down[0]);
+			close(down[1]);
+			break;
+		}
+
+		pid_t pid = fork();
+		if(pid == 0) {
+			close(down[1]);
+			close(up[0]);
+			for(auto it = workers.begin(); it != workers.end(); ++it) {
+				close(it->toChild);
+				close(it->fromChild);
+			}
+			IsolationWorkerMain(down[0], up[1], suites);
+			std::_Exit(0);
+		}
+
+		close(down[0]);
+		close(up[1]);
+		if(pid < 0) {
+			close(down[1]);
+			close(up[0]);
+			break;
+		}
+
+		workers.push_back(IsolationWorker{pid, down[1], up[0], -1, true});
+	}
+
+	if(workers.empty())
+		return false;
+
+	std::vector<char> ran(suites.size(), 0);
+	size_t completedCount = 0;
+	bool aborted = false;
+
+	while(!aborted && completedCount < suites.size()) {
+		// Hand ready suites to idle workers; suites with failed
+		// dependencies are resolved right here in the parent.
+		bool dispatchedAny = true;
+		while(dispatchedAny && !aborted) {
+			dispatchedAny = false;
+			for(auto it = workers.begin(); it != workers.end(); ++it) {
+				if(!it->alive || it->current != -1 || ready.empty())
+					continue;
+
+				size_t idx = ready.front();
+				ready.pop_front();
+				dispatchedAny = true;
+
+				bool localProcceed = true;
+				if(!CheckDependenciesParallel(suites[idx], order,
+						suiteResults, localProcceed)) {
+					if(!localProcceed) {
+						aborted = true;
+						break;
+					}
+					GetControl()->OnSuiteBegin(*suites[idx]);
+					suiteResults[idx].SetTotalResult(Result::Unknown);
+					GetControl()->OnSuiteEnd(suiteResults[idx]);
+					ran[idx] = 1;
+					++completedCount;
+					releaseDependents(idx);
+					continue;
+				}
+
+				std::int32_t msg = (std::int32_t)idx;
+				if(!WriteAllFd(it->toChild, &msg, sizeof(msg))) {
+					// Worker died between suites, put the suite back.
+					ready.push_front(idx);
+					it->alive = false;
+					close(it->toChild);
+					close(it->fromChild);
+					waitpid(it->pid, nullptr, 0);
+					continue;
+				}
+				it->current = msg;
+			}
+		}
+
+		if(aborted || completedCount == suites.size())
+			break;
+
+		std::vector<pollfd> fds;
+		std::vector<size_t> fdWorker;
+		for(size_t i = 0; i < workers.size(); ++i) {
+			if(workers[i].alive && workers[i].current != -1) {
+				pollfd p;
+				p.fd = workers[i].fromChild;
+				p.events = POLLIN;
+				p.revents = 0;
+				fds.push_back(p);
+				fdWorker.push_back(i);
+			}
+		}
+
+		if(fds.empty())
+			break; // No running workers and nothing dispatchable left.
+
+		if(poll(fds.data(), (nfds_t)fds.size(), -1) < 0)
+			break;
+
+		for(size_t i = 0; i < fds.size(); ++i) {
+			if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			IsolationWorker& worker = workers[fdWorker[i]];
+			size_t idx = (size_t)worker.current;
+
+			std::uint32_t size = 0;
+			std::string blob;
+			bool ok = ReadAllFd(worker.fromChild, &size, sizeof(size));
+			if(ok && size) {
+				blob.resize(size);
+				ok = ReadAllFd(worker.fromChild, &blob[0], size);
+			}
+
+			if(ok && DeserializeSuiteResult(blob, suites[idx], suiteResults[idx])) {
+				worker.current = -1;
+			} else {
+				// The worker crashed while running this suite; count the
+				// suite as failed and retire the worker.
+				suiteResults[idx].SetTotalResult(Result::Fail);
+				{
+					std::lock_guard<std::mutex> lock(m_CallbackMutex);
+					GetControl()->OnSuiteEnd(suiteResults[idx]);
+				}
+				worker.alive = false;
+				close(worker.toChild);
+				close(worker.fromChild);
+				waitpid(worker.pid, nullptr, 0);
+			}
+
+			if(m_ResultWriter)
+				m_ResultWriter->WriteSuiteResult(suiteResults[idx]);
+
+			ran[idx] = 1;
+			++completedCount;
+			releaseDependents(idx);
+		}
+
+		bool anyAlive = false;
+		for(auto it = workers.begin(); it != workers.end(); ++it)
+			anyAlive = anyAlive || it->alive;
+		if(!anyAlive)
+			break;
+	}
+
+	for(auto it = workers.begin(); it != workers.end(); ++it) {
+		if(!it->alive)
+			continue;
+		std::int32_t quit = -1;
+		WriteAllFd(it->toChild, &quit, sizeof(quit));
+		close(it->toChild);
+		close(it->fromChild);
+		waitpid(it->pid, nullptr, 0);
+	}
+
+	for(size_t i = 0; i < suites.size(); ++i) {
+		if(ran[i])
+			result.AddResult(std::move(suiteResults[i]));
+	}
+
+	return !aborted;
+}
+#endif // _WIN32
+
+int Environment::TopoVisit(size_t cur, std::vector<Suite*>& result,
+		std::vector<std::pair<bool, bool>>& mark,
+		std::vector<const Suite*>& unsolvable)
+{
+	if(mark[cur].second)
+		return 1;
+
+	if(mark[cur].first)
+		return 0;
+
+	// Iterative depth-first search with an explicit stack; dependency
+	// chains can get deep enough that recursion is a liability. Each
+	// frame remembers which dependency edge it examines next.
+	struct Frame
+	{
+		size_t suite;
+		size_t edge;
+	};
+	std::vector<Frame> stack;
+	stack.push_back(Frame{cur, 0});
+	mark[cur].second = true;
+
+	while(!stack.empty()) {
+		Frame& frame = stack.back();
+		Suite* suite = m_Suites[frame.suite];
+
+		if(frame.edge < suite->GetDependencyCount()) {
+			const std::string& depName = suite->GetDependency((int)frame.edge);
+			++frame.edge;
+
+			auto dep = m_SuiteMap.find(depName);
+			if(dep == m_SuiteMap.end()) {
+				ControlAction action = GetControl()->OnUnknownDependency(
+						*suite, depName);
+				if(action == ControlAction::Ignore)
+					continue;
+				return 2;
+			}
+
+			if(mark[dep->second].first)
+				continue;
+			if(mark[dep->second].second) {
+				unsolvable.push_back(m_Suites[dep->second]);
+				return 1;
+			}
+
+			mark[dep->second].second = true;
+			stack.push_back(Frame{dep->second, 0});
+		} else {
+			mark[frame.suite].first = true;
+			mark[frame.suite].second = false;
+			result.push_back(suite);
+			stack.pop_back();
+		}
+	}
+
+	return 0;
+}
+
+bool Environment::SolveDependenciesFresh(std::vector<Suite*>& result,
+		bool applyFilters)
+{
+	std::vector<std::pair<bool, bool>> mark(m_Suites.size(),
+			std::pair<bool,bool>(false, false));
+	std::vector<const Suite*> unsolvable;
+
+	bool succeded = true;
+	for(size_t i = 0; i < m_Suites.size(); ++i) {
+		if(!mark[i].first && (!applyFilters || AllowSuite(m_Suites[i]))) {
+			succeded = (TopoVisit(i, result, mark, unsolvable) == 0);
+			if(!succeded)
+				break;
+		}
+	}
+
+	if(!succeded) {
+		result.clear();
+		if(!unsolvable.empty())
+			GetControl()->OnUnsolvableDependencies(*this, unsolvable);
+	}
+
+	return succeded;
+}
+
+std::uint64_t Environment::ComputePlanHash() const
+{
+	// FNV-1a over the registered suite names and their dependency
+	// lists; any change to the graph changes the hash and invalidates
+	// the cached order.
+	std::uint64_t hash = 1469598103934665603ull;
+	auto mix = [&hash](const std::string& str) {
+		for(size_t i = 0; i < str.size(); ++i) {
+			hash ^= (unsigned char)str[i];
+			hash *= 1099511628211ull;
+		}
+		hash ^= 0xFF;
+		hash *= 1099511628211ull;
+	};
+
+	for(auto it = m_Suites.begin(); it != m_Suites.end(); ++it) {
+		mix((*it)->GetInfo().GetName());
+		for(size_t d = 0; d < (*it)->GetDependencyCount(); ++d)
+			mix((*it)->GetDependency((int)d));
+	}
+	return hash;
+}
+
+bool Environment::LoadPlanCache(std::vector<Suite*>& fullOrder)
+{
+	if(m_PlanCacheFile.empty())
+		return false;
+
+	std::ifstream file(m_PlanCacheFile);
+	std::string line;
+	if(!std::getline(file, line))
+		return false;
+
+	std::ostringstream expected;
+	expected << std::hex << ComputePlanHash();
+	if(line != expected.str())
+		return false;
+
+	fullOrder.reserve(m_Suites.size());
+	while(std::getline(file, line)) {
+		auto it = m_SuiteMap.find(line);
+		if(it == m_SuiteMap.end())
+			return false;
+		fullOrder.push_back(m_Suites[it->second]);
+	}
+
+	// The cached plan covers every registered suite; anything else
+	// means a stale or truncated file.
+	if(fullOrder.size() != m_Suites.size()) {
+		fullOrder.clear();
+		return false;
+	}
+	return true;
+}
+
+void Environment::SavePlanCache(const std::vector<Suite*>& fullOrder) const
+{
+	if(m_PlanCacheFile.empty())
+		return;
+
+	std::ofstream file(m_PlanCacheFile, std::ios::trunc);
+	file << std::hex << ComputePlanHash() << '\n';
+	for(auto it = fullOrder.begin(); it != fullOrder.end(); ++it)
+		file << (*it)->GetInfo().GetName() << '\n';
+}
+
+void Environment::ReducePlan(const std::vector<Suite*>& fullOrder,
+		std::vector<Suite*>& result) const
+{
+	std::unordered_map<const Suite*, size_t> indexOf;
+	for(size_t i = 0; i < fullOrder.size(); ++i)
+		indexOf[fullOrder[i]] = i;
+
+	// A suite is needed if a filter allows it or if a needed suite
+	// depends on it. Dependencies precede their dependents in the
+	// order, so one reverse sweep collects the transitive closure.
+	std::vector<char> needed(fullOrder.size(), 0);
+	for(size_t i = 0; i < fullOrder.size(); ++i) {
+		if(AllowSuite(fullOrder[i]))
+			needed[i] = 1;
+	}
+
+	for(size_t i = fullOrder.size(); i-- > 0;) {
+		if(!needed[i])
+			continue;
+		for(size_t d = 0; d < fullOrder[i]->GetDependencyCount(); ++d) {
+			auto dep = m_SuiteMap.find(fullOrder[i]->GetDependency((int)d));
+			if(dep != m_SuiteMap.end())
+				needed[indexOf[m_Suites[dep->second]]] = 1;
+		}
+	}
+
+	for(size_t i = 0; i < fullOrder.size(); ++i) {
+		if(needed[i])
+			result.push_back(fullOrder[i]);
+	}
+}
+
+bool Environment::SolveDependencies(std::vector<Suite*>& result)
+{
+	if(m_PlanCacheFile.empty())
+		return SolveDependenciesFresh(result, true);
+
+	std::vector<Suite*> fullOrder;
+	if(!LoadPlanCache(fullOrder)) {
+		if(!SolveDependenciesFresh(fullOrder, false))
+			return false;
+		SavePlanCache(fullOrder);
+	}
+
+	ReducePlan(fullOrder, result);
+	return true;
+}
+
+void Environment::Run()
+{
+	ConsoleCallback fallbackCallback;
+
+	if(!m_Callback)
+		m_Callback = &fallbackCallback;
+
+	EnvironmentResult result(this);
+	std::vector<Suite*> performSuites;
+
+	bool isolate = false;
+#ifndef _WIN32
+	isolate = m_ProcessIsolation;
+#endif
+
+	if(m_ThreadCount > 1 && !isolate)
+		m_WorkerPool.Start(m_ThreadCount);
+
+	LoadBaselines();
+	LoadResultCache();
+
+	if(SolveDependencies(performSuites)) {
+		FilterShard(performSuites);
+		GetControl()->OnBegin(*this);
+		if(m_AsyncReporting && !isolate)
+			m_Reporter.Start(GetControl(), &m_CallbackMutex);
+#ifndef _WIN32
+		if(isolate)
+			RunSuitesIsolated(performSuites, result);
+		else
+#endif
+		if(m_ThreadCount > 1)
+			RunSuitesParallel(performSuites, result);
+		else
+			RunSuites(performSuites, result);
+		m_Reporter.Stop();
+		GetControl()->OnEnd(result);
+		SaveBaselines(result);
+		SaveResultCache();
+	}
+
+	m_WorkerPool.Stop();
+
+	if(m_Callback == &fallbackCallback)
+		m_Callback = nullptr;
+}
+
+void Environment::Run(size_t shardIndex, size_t shardCount)
+{
+	m_ShardCount = shardCount ? shardCount : 1;
+	m_ShardIndex = shardIndex % m_ShardCount;
+	Run();
+	m_ShardIndex = 0;
+	m_ShardCount = 1;
+}
+
+void Environment::FilterShard(std::vector<Suite*>& suites) const
+{
+	if(m_ShardCount < 2)
+		return;
+
+	// Union every suite with its dependencies, so each connected
+	// component of the dependency graph stays on one shard and no shard
+	// ever misses a dependency of a suite it runs.
+	std::vector<size_t> parent(m_Suites.size());
+	for(size_t i = 0; i < parent.size(); ++i)
+		parent[i] = i;
+	auto findRoot = [&parent](size_t i) {
+		while(parent[i] != i) {
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	};
+	for(size_t i = 0; i < m_Suites.size(); ++i) {
+		for(size_t d = 0; d < m_Suites[i]->GetDependencyCount(); ++d) {
+			auto dep = m_SuiteMap.find(m_Suites[i]->GetDependency((int)d));
+			if(dep == m_SuiteMap.end())
+				continue;
+			size_t a = findRoot(i);
+			size_t b = findRoot(dep->second);
+			if(a != b)
+				parent[b] = a;
+		}
+	}
+
+	// Weigh each component by the historical durations from the result
+	// cache; tests without history count one millisecond so fresh
+	// binaries still get a balanced, deterministic split.
+	std::map<size_t, double> weights;
+	std::map<size_t, size_t> firstSeen;
+	for(size_t i = 0; i < suites.size(); ++i) {
+		size_t root = findRoot(m_SuiteMap.at(suites[i]->GetInfo().GetName()));
+		double weight = 0;
+		for(size_t t = 0; t < suites[i]->GetTestCount(); ++t) {
+			Result outcome;
+			double milliseconds;
+			if(GetCachedOutcome(suites[i]->GetTest((int)t), outcome,
+					milliseconds))
+				weight += milliseconds;
+			else
+				weight += 1;
+		}
+		weights[root] += weight;
+		if(firstSeen.find(root) == firstSeen.end())
+			firstSeen[root] = i;
+	}
+
+	// Greedy balance: heaviest component onto the currently lightest
+	// shard, ties broken by position so every machine computes the same
+	// partition.
+	std::vector<std::pair<size_t, double>> components(weights.begin(),
+			weights.end());
+	std::stable_sort(components.begin(), components.end(),
+			[&firstSeen](const std::pair<size_t, double>& a,
+					const std::pair<size_t, double>& b) {
+		if(a.second != b.second)
+			return a.second > b.second;
+		return firstSeen.at(a.first) < firstSeen.at(b.first);
+	});
+
+	std::vector<double> load(m_ShardCount, 0);
+	std::map<size_t, size_t> shardOf;
+	for(auto it = components.begin(); it != components.end(); ++it) {
+		size_t lightest = 0;
+		for(size_t s = 1; s < load.size(); ++s) {
+			if(load[s] < load[lightest])
+				lightest = s;
+		}
+		shardOf[it->first] = lightest;
+		load[lightest] += it->second;
+	}
+
+	std::vector<Suite*> kept;
+	for(auto it = suites.begin(); it != suites.end(); ++it) {
+		size_t root = findRoot(m_SuiteMap.at((*it)->GetInfo().GetName()));
+		if(shardOf[root] == m_ShardIndex)
+			kept.push_back(*it);
+	}
+	suites.swap(kept);
+}
+
+}
+
+#ifdef UNIT_TESTING_TRACK_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+
+void* operator new(std::size_t size)
+{
+	UnitTesting::CountAllocation(size);
+	void* ptr = std::malloc(size);
+	if(!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void* operator new[](std::size_t size)
+{
+	UnitTesting::CountAllocation(size);
+	void* ptr = std::malloc(size);
+	if(!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+	if(ptr) {
+		UnitTesting::CountFree();
+		std::free(ptr);
+	}
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	if(ptr) {
+		UnitTesting::CountFree();
+		std::free(ptr);
+	}
+}
+#endif // UNIT_TESTING_TRACK_ALLOCATIONS
\ No newline at end of file
@@ -3,8 +3,22 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <iostream>
+#include <sstream>
 #include <set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <fstream>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <algorithm>
 
 namespace UnitTesting
 {
@@ -17,11 +31,36 @@ class TestContext;
 class Filter;
 class ControlCallback;
 typedef void (*TestFunction)(TestContext&);
+// Caller-supplied content fingerprint of a test, e.g. a hash of the
+// sources it covers; an empty string means "always run".
+typedef std::string (*FingerprintFunction)(const Test&);
+
+// Process-lifetime pool of interned strings. Identical names and
+// __FILE__ paths are stored once and shared by every Info that uses
+// them; entries are never removed, so references stay valid.
+class StringPool
+{
+public:
+	static StringPool& Instance();
+	const std::string& Intern(const std::string& str);
+
+private:
+	std::set<std::string> m_Strings;
+	std::mutex m_Mutex;
+};
 
 struct Info
 {
 	Info();
 	Info(const std::string& name, const std::string& file, int line);
+	// The overload the macros hit: #name and __FILE__ are literals that
+	// live forever, so registration just stores the pointers and defers
+	// interning until a result actually asks for the string. This keeps
+	// the static-init registration path free of allocations.
+	Info(const char* name, const char* file, int line);
+	// Hand-written because the atomic cache pointers are not copyable.
+	Info(const Info& other);
+	Info& operator=(const Info& other);
 
 	const std::string& GetName() const;
 	const std::string& GetFile() const;
@@ -32,8 +71,17 @@ struct Info
 	const Test* test;
 
 private:
-	std::string m_Name;
-	std::string m_File;
+	const std::string& OwnFile() const;
+
+private:
+	const char* m_NameLiteral;
+	const char* m_FileLiteral;
+	// Lazily interned caches. Atomic because several threads can hit
+	// the first GetName() of a shared static Info at once under the
+	// parallel runner; every racer interns the identical pooled string,
+	// so losing the store race is harmless.
+	mutable std::atomic<const std::string*> m_Name;
+	mutable std::atomic<const std::string*> m_File;
 	int m_Line;
 };
 
@@ -41,7 +89,8 @@ enum class Result
 {
 	Success,
 	Fail,
-	Unknown
+	Unknown,
+	Timeout
 };
 
 enum class ControlAction
@@ -53,6 +102,35 @@ enum class ControlAction
 	Repeat
 };
 
+enum class ResultRetention
+{
+	All,          // Store every AssertResult, successes included.
+	FailuresOnly  // Store failed asserts, count passing ones.
+};
+
+enum class TestOrdering
+{
+	Registration, // Run tests in the order they were registered.
+	FailureFirst  // Previously failed tests first, then slowest first.
+};
+
+// Plain thread-local allocation counters, cheap enough to stay enabled
+// permanently. They only tick when the test binary is compiled with
+// UNIT_TESTING_TRACK_ALLOCATIONS, which hooks the global operator
+// new/delete in UnitTesting.cpp; otherwise every value stays zero.
+struct AllocationCounters
+{
+	AllocationCounters();
+
+	size_t allocationCount;
+	size_t allocatedBytes;
+	size_t freeCount;
+};
+
+AllocationCounters GetThreadAllocationCounters();
+void CountAllocation(size_t bytes);
+void CountFree();
+
 class ResultObject
 {
 public:
@@ -78,19 +156,137 @@ struct AssertResult : public ResultObject
 class TestContext
 {
 public:
-	TestContext(TestResult& r);
+	// The abandoned flag is set by the watchdog when it gives up on a
+	// hung body; a context carrying it stops reporting, since by then
+	// the run (and the user's callback) may be gone.
+	TestContext(TestResult& r, const std::atomic<bool>* abandoned = nullptr);
 	void AddResult(const Info& info, bool result, const std::string& msg);
 
+	// Fast path for UNIT_CHECK: a passing check only increments a counter,
+	// the failure path materializes a full AssertResult.
+	bool Check(bool result);
+	void CheckFailed(const Info& info, const std::string& msg);
+	// Failure path of UNIT_CHECK_FMT: the message is a printf format
+	// plus arguments and is only rendered here, never on a passing
+	// check.
+	void CheckFailedFormat(const Info& info, const char* format, ...);
+	void CountPassedChecks(size_t count);
+
+	const Test& GetTest() const;
+
+	// Allocations on this thread since the test body started; usable to
+	// assert that a test body does not touch the heap.
+	AllocationCounters GetAllocationDelta() const;
+
 private:
 	TestResult& m_Results;
+	AllocationCounters m_StartAllocations;
+	const std::atomic<bool>* m_Abandoned;
+};
+
+// Per-case context of a parameterized test. A passing check is one
+// counter increment, only a failing check materializes an AssertResult
+// that names the case index; there is no per-case Info or string
+// construction.
+class CaseContext
+{
+public:
+	CaseContext(TestContext& ctx, const Info& info, std::mutex* failMutex);
+
+	bool Check(bool result)
+	{
+		if(result) {
+			++m_Passed;
+			return true;
+		}
+
+		return false;
+	}
+
+	void CheckFailed(const char* expression);
+
+	void SetCaseIndex(size_t index)
+	{
+		m_Index = index;
+	}
+
+	size_t GetCaseIndex() const
+	{
+		return m_Index;
+	}
+
+	size_t GetPassedCount() const
+	{
+		return m_Passed;
+	}
+
+private:
+	TestContext& m_Ctx;
+	Info m_Info;
+	std::mutex* m_FailMutex;
+	size_t m_Passed;
+	size_t m_Index;
+};
+
+template <typename RangeT>
+struct CaseParam
+{
+	typedef typename std::decay<decltype(*std::begin(
+			std::declval<const RangeT&>()))>::type type;
+};
+
+// Hardware counter readings around one test body. Only filled on Linux
+// via perf_event_open and when counters are enabled on the Environment;
+// valid stays false if the counters could not be opened.
+struct PerfCounterValues
+{
+	PerfCounterValues();
+
+	bool valid;
+	unsigned long long instructions;
+	unsigned long long cycles;
+	unsigned long long cacheMisses;
+	unsigned long long branchMisses;
+};
+
+struct BenchmarkStats
+{
+	BenchmarkStats();
+
+	size_t iterations;
+	double minMilliseconds;
+	double medianMilliseconds;
+	double stddevMilliseconds;
+	double iterationsPerSecond;
+};
+
+// How a stress test repeats its body. Count and Timed limits may be
+// combined, whichever is hit first stops the loop. FixturePerIteration
+// additionally runs the suite's fixture enter/leave around every
+// iteration, for hunting races that need fresh fixture state.
+struct StressSpec
+{
+	StressSpec();
+
+	static StressSpec Count(size_t iterations);
+	static StressSpec Timed(double milliseconds);
+	StressSpec FixturePerIteration() const;
+
+	bool IsActive() const;
+
+	size_t iterations;   // 0 means no iteration limit.
+	double milliseconds; // 0 means no time limit.
+	bool fixtureEachIteration;
 };
 
 class TestResult : public ResultObject
 {
 public:
 	TestResult(Test* test);
+	TestResult(Test* test, ResultRetention retention);
 
 	void AddResult(const AssertResult& result);
+	void AddResult(AssertResult&& result);
 	void SetTime(double t);
 
 	size_t GetAssertCount() const;
@@ -98,26 +294,89 @@ public:
 	const Test& GetTest() const;
 	double GetMilliseconds() const;
 
+	void SetBenchmarkStats(const BenchmarkStats& stats);
+	bool HasBenchmarkStats() const;
+	const BenchmarkStats& GetBenchmarkStats() const;
+
+	void SetPerfCounters(const PerfCounterValues& values);
+	const PerfCounterValues& GetPerfCounters() const;
+
+	void SetAllocations(const AllocationCounters& counters);
+	const AllocationCounters& GetAllocations() const;
+
+	void CountPassedCheck()
+	{
+		++m_PassedCheckCount;
+	}
+
+	void SetPassedCheckCount(size_t count)
+	{
+		m_PassedCheckCount = count;
+	}
+
+	size_t GetPassedCheckCount() const
+	{
+		return m_PassedCheckCount;
+	}
+
 private:
 	Test* m_Test;
+	ResultRetention m_Retention;
 	std::vector<AssertResult> m_Results;
+	size_t m_PassedCheckCount;
 	double m_Milliseconds;
+	BenchmarkStats m_BenchmarkStats;
+	bool m_HasBenchmarkStats;
+	PerfCounterValues m_PerfCounters;
+	AllocationCounters m_Allocations;
 };
 
+inline bool TestContext::Check(bool result)
+{
+	if(result) {
+		m_Results.CountPassedCheck();
+		return true;
+	}
+
+	return false;
+}
+
+inline void TestContext::CountPassedChecks(size_t count)
+{
+	m_Results.SetPassedCheckCount(m_Results.GetPassedCheckCount() + count);
+}
+
+inline const Test& TestContext::GetTest() const
+{
+	return m_Results.GetTest();
+}
+
 class Test
 {
 friend class Suite;
 public:
 	Test(Suite& s, TestFunction func, const Info& info);
+	Test(Suite& s, TestFunction func, const Info& info, bool benchmark);
+	Test(Suite& s, TestFunction func, const Info& info,
+			const StressSpec& stress);
 	const Info& GetInfo() const;
 	const Suite& GetSuite() const;
+	bool IsBenchmark() const;
+	bool IsStress() const;
 
 private:
 	bool Run(TestResult& result);
+	bool RunWithWatchdog(TestResult& result, double timeoutMilliseconds);
+	void RunBenchmark(TestContext& ctx, TestResult& result);
+	bool RunStress(TestResult& result);
+	bool HandleException(TestResult& result);
 
 private:
 	TestFunction m_Func;
 	Info m_Info;
+	Suite* m_Suite;
+	bool m_IsBenchmark;
+	StressSpec m_Stress;
 };
 
 class SuiteResult : public ResultObject
@@ -125,15 +384,25 @@ class SuiteResult : public ResultObject
 public:
 	SuiteResult(Suite* suite);
 	void AddResult(const TestResult& result);
+	void AddResult(TestResult&& result);
 	size_t GetResultCount() const;
 	const TestResult& GetResult(size_t i) const;
 	const TestResult& GetResult(const std::string& name) const;
 	const Suite& GetSuite() const;
 	void SetTotalResult(Result result);
 
+	// Sum of the test times in this suite.
+	double GetMilliseconds() const;
+	// Time spent in m_Init/m_Enter/m_Leave/m_Exit, outside any test body.
+	double GetFixtureMilliseconds() const;
+	void AddFixtureTime(double t);
+
 private:
 	Suite* m_Suite;
 	std::vector<TestResult> m_Results;
+	std::unordered_map<std::string, size_t> m_ResultMap;
+	double m_Milliseconds;
+	double m_FixtureMilliseconds;
 };
 
 class SuiteFunction
@@ -142,6 +411,7 @@ public:
 	SuiteFunction();
 	SuiteFunction(void(*f)(), const Info& info);
 	const Info& GetInfo() const;
+	bool IsValid() const;
 	void operator()() const;
 
 private:
@@ -168,9 +438,13 @@ public:
 	const Environment& GetEnvironment() const;
 	const Info& GetInfo() const;
 	bool CheckTag(const std::string& tag) const;
+	std::uint64_t GetTagBits() const;
 
 private:
 	bool Run(SuiteResult& result);
+	bool RunTestsSerial(SuiteResult& result);
+	bool RunTestsParallel(SuiteResult& result);
+	std::vector<Test*> OrderedTests() const;
 	void RegisterInit(void (*func)(), Info info);
 	void RegisterExit(void (*func)(), Info info);
 	void RegisterFixtureEnter(void (*func)(), Info info);
@@ -178,7 +452,8 @@ private:
 	void RegisterTest(Test* t);
 	void RegisterDependency(const std::string& name);
 	void AddTag(const std::string& tag);
-	bool ExecFunction(const SuiteFunction& func, bool& procceed);
+	bool ExecFunction(const SuiteFunction& func, bool& procceed,
+			SuiteResult* result);
 
 private:
 	SuiteFunction m_Init;
@@ -190,7 +465,8 @@ private:
 
 	std::vector<std::string> m_Dependencies;
 	std::vector<Test*> m_Tests;
-	std::set<std::string> m_Tags;
+	std::uint64_t m_TagBits;
+	std::set<std::string> m_Tags; // Only tags beyond the first 64 IDs.
 };
 
 class EnvironmentResult : public ResultObject
@@ -198,19 +474,242 @@ class EnvironmentResult : public ResultObject
 public:
 	EnvironmentResult(Environment* env);
 	void AddResult(const SuiteResult& result);
+	void AddResult(SuiteResult&& result);
 	size_t GetResultCount() const;
 	const SuiteResult& GetResult(size_t i) const;
 	const SuiteResult& GetResult(const std::string& name) const;
 	const Environment& GetEnvironment() const;
 
+	// Sum of the test times over all suites.
+	double GetMilliseconds() const;
+	// Sum of the fixture times over all suites.
+	double GetFixtureMilliseconds() const;
+
 private:
 	Environment* m_Environment;
 	std::vector<SuiteResult> m_Results;
+	std::unordered_map<std::string, size_t> m_ResultMap;
+	double m_Milliseconds;
+	double m_FixtureMilliseconds;
+};
+
+// Reads the stream produced by BinaryResultWriter back into plain
+// records, for report generation outside of the test process.
+class BinaryResultReader
+{
+public:
+	struct AssertRecord
+	{
+		std::string message;
+		Result result;
+		int line;
+	};
+
+	struct TestRecord
+	{
+		std::string name;
+		Result result;
+		double milliseconds;
+		size_t passedChecks;
+		std::vector<AssertRecord> asserts;
+	};
+
+	struct SuiteRecord
+	{
+		std::string name;
+		Result result;
+		std::vector<TestRecord> tests;
+	};
+
+	bool Open(const std::string& path);
+
+	size_t GetSuiteCount() const;
+	const SuiteRecord& GetSuite(size_t i) const;
+
+private:
+	bool Read8(std::istream& file, std::uint8_t& value);
+	bool Read32(std::istream& file, std::uint32_t& value);
+	bool Read64(std::istream& file, std::uint64_t& value);
+	bool ReadDouble(std::istream& file, double& value);
+
+private:
+	std::vector<SuiteRecord> m_Suites;
+};
+
+// Writes results as a compact binary stream: one fixed-layout record per
+// finished suite/test/assert referencing names through a string table
+// that is appended on Close. Suites are emitted as they complete, so a
+// long run never has to keep finished results resident for the writer.
+class BinaryResultWriter
+{
+public:
+	BinaryResultWriter();
+	~BinaryResultWriter();
+
+	bool Open(const std::string& path);
+	void WriteSuiteResult(const SuiteResult& result);
+	void WriteSuiteRecord(const BinaryResultReader::SuiteRecord& record);
+	void Close();
+
+	static const std::uint32_t MAGIC = 0x52425455; // "UTBR"
+	static const std::uint32_t VERSION = 1;
+
+private:
+	std::uint32_t InternString(const std::string& str);
+	void Write8(std::uint8_t value);
+	void Write32(std::uint32_t value);
+	void Write64(std::uint64_t value);
+	void WriteDouble(double value);
+
+private:
+	std::ofstream m_File;
+	std::unordered_map<std::string, std::uint32_t> m_StringIds;
+	std::vector<std::string> m_Strings;
+	std::mutex m_Mutex;
+};
+
+// Combines the binary artifacts of the shards of a distributed run
+// into one stream, as if a single process had produced it. Inputs are
+// concatenated in the given order; returns false if any input cannot
+// be read or the output cannot be written.
+bool MergeBinaryResults(const std::vector<std::string>& inputFiles,
+		const std::string& outputFile);
+
+class TaskGroup
+{
+friend class WorkerPool;
+public:
+	TaskGroup();
+
+private:
+	std::atomic<size_t> m_Pending;
+};
+
+class WorkerPool
+{
+public:
+	WorkerPool();
+	~WorkerPool();
+
+	void Start(size_t threadCount);
+	void Stop();
+	size_t GetThreadCount() const;
+
+	void Push(std::function<void()> task);
+	void Push(TaskGroup& group, std::function<void()> task);
+	void WaitIdle();
+	void WaitGroup(TaskGroup& group);
+
+private:
+	struct Task
+	{
+		TaskGroup* group;
+		std::function<void()> func;
+	};
+
+	void WorkerMain();
+	void ExecuteTask(std::unique_lock<std::mutex>& lock, Task task);
+
+private:
+	std::vector<std::thread> m_Threads;
+	std::deque<Task> m_Tasks;
+	mutable std::mutex m_Mutex;
+	std::condition_variable m_TaskAvailable;
+	std::condition_variable m_TaskDone;
+	std::condition_variable m_Idle;
+	size_t m_Running;
+	bool m_Shutdown;
+};
+
+// Decouples reporting from the execution path: worker threads push
+// event records onto a lock-free stack and a dedicated reporter thread
+// drains it and invokes the ControlCallback, so formatting and file
+// I/O in the callback never land on a test's measured time. Events
+// that carry results hold their own copies, they outlive the run loop
+// that produced them.
+class AsyncReporter
+{
+public:
+	AsyncReporter();
+	~AsyncReporter();
+
+	// The reporter dispatches under callbackMutex, the same lock the
+	// synchronous decision hooks (OnException, dependency failures)
+	// take, so the callback is never entered from two threads at once.
+	void Start(ControlCallback* callback, std::mutex* callbackMutex);
+	void Stop();
+	bool IsRunning() const;
+
+	void PushTestBegin(Test* test);
+	void PushTestEnd(const TestResult& result);
+	void PushAssert(const AssertResult& result);
+	void PushSuiteBegin(Suite* suite);
+	void PushSuiteEnd(const SuiteResult& result);
+	void PushTimeRegression(const TestResult& result,
+			double baselineMilliseconds);
+
+private:
+	struct Event
+	{
+		Event() : next(nullptr) {}
+		virtual ~Event() {}
+		virtual void Dispatch(ControlCallback* callback) = 0;
+
+		Event* next;
+	};
+
+	void Push(Event* event);
+	void ReporterMain();
+
+private:
+	ControlCallback* m_Callback;
+	std::mutex* m_CallbackMutex;
+	std::atomic<Event*> m_Pending;
+	std::atomic<bool> m_Running;
+	std::thread m_Thread;
+};
+
+// A boolean tag expression like "smoke & !slow" or "net | db",
+// compiled once into a small postfix program. Tags are interned to bit
+// IDs at registration, so evaluating a suite is a handful of bit tests
+// instead of string-set probes; only tags beyond the first 64 fall
+// back to the suite's overflow set.
+class TagExpression
+{
+public:
+	bool Compile(const std::string& expression, const Environment& env);
+	bool IsEmpty() const;
+	bool Matches(const Suite& suite) const;
+
+private:
+	enum class OpCode
+	{
+		Tag,
+		And,
+		Or,
+		Not
+	};
+
+	struct Op
+	{
+		OpCode code;
+		std::uint64_t mask;     // Bit of the tag, 0 for overflow tags.
+		const std::string* tag; // Interned name, for overflow tags only.
+	};
+
+	bool ParseOr(const std::string& s, size_t& pos, const Environment& env);
+	bool ParseAnd(const std::string& s, size_t& pos, const Environment& env);
+	bool ParseUnary(const std::string& s, size_t& pos, const Environment& env);
+
+private:
+	std::vector<Op> m_Program;
 };
 
 class Environment
 {
 friend class Suite;
+friend class TestContext;
+friend class Test;
 public:
 	Environment();
 	static Environment& Instance();
@@ -221,11 +720,98 @@ public:
 	void SetControl(ControlCallback* control);
 	ControlCallback* GetControl() const;
 
+	void SetThreadCount(size_t count);
+	size_t GetThreadCount() const;
+
+	void SetResultRetention(ResultRetention retention);
+	ResultRetention GetResultRetention() const;
+
+	void SetResultWriter(BinaryResultWriter* writer);
+	BinaryResultWriter* GetResultWriter() const;
+
+	// Persist per-test timings to the given file and report tests whose
+	// time exceeds the stored baseline by thresholdFactor through
+	// ControlCallback::OnTimeRegression on the next run.
+	void SetBaselineFile(const std::string& path, double thresholdFactor);
+
+	void SetPerfCountersEnabled(bool enabled);
+	bool GetPerfCountersEnabled() const;
+
+	// Run suites in a pool of preforked worker processes, so a crashing
+	// test only loses its own suite instead of the whole run. The pool
+	// size follows SetThreadCount. Not available on Windows.
+	void SetProcessIsolation(bool enabled);
+	bool GetProcessIsolation() const;
+
+	// Watchdog deadlines in milliseconds, 0 disables them. A test that
+	// exceeds the test timeout is recorded as Result::Timeout and the
+	// run continues; once a suite exceeds the suite timeout its
+	// remaining tests are recorded as timed out without running.
+	void SetTestTimeout(double milliseconds);
+	double GetTestTimeout() const;
+	void SetSuiteTimeout(double milliseconds);
+	double GetSuiteTimeout() const;
+
+	// Incremental execution: tests whose fingerprint matches the cache
+	// from the last run are not executed, their cached success is
+	// replayed through the normal callback flow instead.
+	void SetResultCacheFile(const std::string& path);
+	void SetFingerprintFunction(FingerprintFunction func);
+
+	// Persists the resolved suite order keyed by a hash of the
+	// registered suite/dependency set; while the graph is unchanged,
+	// later invocations load it instead of re-running the topological
+	// sort. Filters are applied to the cached order on every run.
+	void SetPlanCacheFile(const std::string& path);
+
+	// Route the notification callbacks (OnAssert, OnTestBegin/End,
+	// OnSuiteBegin/End, OnTimeRegression) through an AsyncReporter
+	// thread instead of calling them inline. The decision callbacks
+	// (OnException, the dependency hooks) stay synchronous, and a
+	// repeat request from OnTestEnd is ignored in this mode.
+	void SetAsyncReporting(bool enabled);
+	bool GetAsyncReporting() const;
+
+	// FailureFirst runs the tests of each suite ordered by the persisted
+	// results of the previous run: failed tests first, then tests without
+	// history, then passing tests from slowest to fastest. Needs a result
+	// cache file to have any effect. Suites themselves keep their
+	// dependency order.
+	void SetTestOrdering(TestOrdering ordering);
+	TestOrdering GetTestOrdering() const;
+
 	void AddFilter(Filter* filter);
 	void RemoveFilter(Filter* filter);
 
+	// Selects suites by a compiled boolean tag expression, e.g.
+	// "smoke & !slow"; checked before the Filter chain, so no virtual
+	// calls happen when only tag filtering is used. An empty expression
+	// allows everything; returns false if the expression cannot be
+	// parsed.
+	bool SetTagExpression(const std::string& expression);
+
+	// The process-wide tag registry backing the suite bitmasks; IDs are
+	// assigned in first-seen order.
+	size_t InternTag(const std::string& tag) const;
+	bool FindTag(const std::string& tag, size_t& id) const;
+
+	// Splits a parameterized test's cases into batches and runs them on
+	// the worker pool when it is active, serially otherwise. runBatch
+	// receives the first case index and the number of cases of its
+	// batch. Used by RunCases, not meant to be called directly.
+	void RunCaseBatches(size_t caseCount, size_t batchSize,
+			const std::function<void(size_t, size_t)>& runBatch) const;
+
 	void Run();
 
+	// Runs only the shard's deterministic share of the suites, for
+	// splitting one logical run across several machines. A suite and
+	// its transitive dependencies always land in the same shard; shards
+	// are balanced by the historical durations from the result cache
+	// when available, by test count otherwise. Merge the per-shard
+	// binary artifacts with MergeBinaryResults.
+	void Run(size_t shardIndex, size_t shardCount);
+
 private:
 	void RegisterSuite(Suite* suite);
 
@@ -234,11 +820,44 @@ private:
 			EnvironmentResult& result, bool& Procceed,
 			const std::vector<size_t>& resultConnector);
 	bool RunSuites(const std::vector<Suite*>& suites, EnvironmentResult& result);
+	bool RunSuitesParallel(const std::vector<Suite*>& suites,
+			EnvironmentResult& result);
+	bool CheckDependenciesParallel(const Suite* s,
+			const std::map<std::string, size_t>& order,
+			const std::vector<SuiteResult>& results, bool& Procceed);
 	int TopoVisit(size_t cur, std::vector<Suite*>& result, 
 			std::vector<std::pair<bool, bool>>& mark,
 			std::vector<const Suite*>& unsolvable);
 	bool SolveDependencies(std::vector<Suite*>& result);
+	bool SolveDependenciesFresh(std::vector<Suite*>& result,
+			bool applyFilters);
+	std::uint64_t ComputePlanHash() const;
+	bool LoadPlanCache(std::vector<Suite*>& fullOrder);
+	void SavePlanCache(const std::vector<Suite*>& fullOrder) const;
+	void ReducePlan(const std::vector<Suite*>& fullOrder,
+			std::vector<Suite*>& result) const;
 	bool AllowSuite(const Suite* s) const;
+	WorkerPool& GetWorkerPool() const;
+	std::mutex& GetCallbackMutex() const;
+	void LoadBaselines();
+	void SaveBaselines(const EnvironmentResult& result);
+	void CheckTimeRegression(const TestResult& result) const;
+	bool RunSuitesIsolated(const std::vector<Suite*>& suites,
+			EnvironmentResult& result);
+	void IsolationWorkerMain(int readFd, int writeFd,
+			const std::vector<Suite*>& suites);
+	void LoadResultCache();
+	void SaveResultCache();
+	bool TryReplayCachedResult(Test* test, TestResult& result) const;
+	void CacheTestResult(const TestResult& result) const;
+	bool GetCachedOutcome(const Test& test, Result& outcome,
+			double& milliseconds) const;
+	void FilterShard(std::vector<Suite*>& suites) const;
+	void ReportAssert(AssertResult& result) const;
+	void ReportTestBegin(Test& test) const;
+	bool ReportTestEnd(const TestResult& result) const;
+	void ReportSuiteBegin(Suite& suite) const;
+	void ReportSuiteEnd(const SuiteResult& result) const;
 
 private:
 	std::map<std::string, size_t> m_SuiteMap;
@@ -246,8 +865,75 @@ private:
 
 	ControlCallback* m_Callback;
 	std::vector<Filter*> m_Filter;
+	TagExpression m_TagExpression;
+	mutable std::map<std::string, size_t> m_TagIds;
+	mutable std::mutex m_TagMutex;
+
+	size_t m_ThreadCount;
+	ResultRetention m_Retention;
+	BinaryResultWriter* m_ResultWriter;
+
+	std::string m_BaselineFile;
+	double m_BaselineThreshold;
+	std::map<std::string, double> m_Baselines;
+
+	bool m_PerfCountersEnabled;
+	bool m_ProcessIsolation;
+	double m_TestTimeout;
+	double m_SuiteTimeout;
+
+	struct CachedTestResult
+	{
+		std::string fingerprint;
+		Result result;
+		double milliseconds;
+	};
+
+	std::string m_CacheFile;
+	FingerprintFunction m_Fingerprint;
+	std::string m_PlanCacheFile;
+	TestOrdering m_Ordering;
+	size_t m_ShardIndex;
+	size_t m_ShardCount;
+	bool m_AsyncReporting;
+	mutable AsyncReporter m_Reporter;
+	mutable std::map<std::string, CachedTestResult> m_ResultCache;
+	mutable std::mutex m_CacheMutex;
+	mutable WorkerPool m_WorkerPool;
+	mutable std::mutex m_CallbackMutex;
 };
 
+// Drives a parameterized test: one direct call of func per element of
+// the range. Passing cases are aggregated into the passed-check count
+// in one step at the end; failing cases go through CaseContext and are
+// the only ones that allocate. Batches become worker pool tasks when
+// the pool is active, so large ranges spread over the pool's threads.
+template <typename RangeT, typename CaseFunctionT>
+void RunCases(TestContext& ctx, const RangeT& range, CaseFunctionT func,
+		const Info& info)
+{
+	auto begin = std::begin(range);
+	size_t count = (size_t)std::distance(begin, std::end(range));
+	const Environment& env = ctx.GetTest().GetSuite().GetEnvironment();
+
+	std::mutex failMutex;
+	std::atomic<size_t> passed(0);
+	env.RunCaseBatches(count, 1024,
+			[&ctx, &info, &failMutex, &passed, &begin, func](
+					size_t first, size_t batchCount) {
+		CaseContext caseCtx(ctx, info, &failMutex);
+		auto it = begin;
+		std::advance(it, (std::ptrdiff_t)first);
+		for(size_t i = 0; i < batchCount; ++i, ++it) {
+			caseCtx.SetCaseIndex(first + i);
+			func(caseCtx, *it);
+		}
+		passed += caseCtx.GetPassedCount();
+	});
+
+	ctx.CountPassedChecks(passed.load());
+}
+
 struct RegisterInit
 {
 	RegisterInit(Suite& s, void(*f)(), const Info& info)
@@ -306,6 +992,8 @@ public:
 	virtual void OnTestBegin(Test& test) {}
 	virtual void OnAssert(AssertResult& result) {}
 	virtual bool OnTestEnd(const TestResult& result) { return false; }
+	virtual void OnTimeRegression(const TestResult& result,
+			double baselineMilliseconds) {}
 	virtual void OnSuiteEnd(const SuiteResult& result) {}
 	virtual void OnEnd(const EnvironmentResult& result) {}
 
@@ -325,9 +1013,67 @@ public:
 	virtual bool IsOK(const Test& test) = 0;
 };
 
+// Writes the end-of-run hot-path report: total and fixture time plus
+// the slowest tests and suites, so finding where a long run spends its
+// time needs no post-processing of the per-test lines.
+inline void WriteTimingReport(std::ostream& out,
+		const EnvironmentResult& result, size_t slowestCount)
+{
+	if(slowestCount == 0)
+		return;
+
+	std::vector<std::pair<double, std::string>> tests;
+	std::vector<std::pair<double, std::string>> suites;
+	for(size_t i = 0; i < result.GetResultCount(); ++i) {
+		const SuiteResult& suite = result.GetResult(i);
+		const std::string& suiteName = suite.GetSuite().GetInfo().GetName();
+		suites.emplace_back(
+				suite.GetMilliseconds() + suite.GetFixtureMilliseconds(),
+				suiteName);
+		for(size_t j = 0; j < suite.GetResultCount(); ++j) {
+			const TestResult& test = suite.GetResult(j);
+			tests.emplace_back(test.GetMilliseconds(),
+					suiteName + "/" + test.GetTest().GetInfo().GetName());
+		}
+	}
+
+	double testMillis = result.GetMilliseconds();
+	double fixtureMillis = result.GetFixtureMilliseconds();
+	double totalMillis = testMillis + fixtureMillis;
+	out << "Total time: " << totalMillis << "ms";
+	if(totalMillis > 0)
+		out << ", fixtures: " << fixtureMillis << "ms (" <<
+				(100.0 * fixtureMillis / totalMillis) << "%)";
+	out << "\n";
+
+	auto slower = [](const std::pair<double, std::string>& a,
+			const std::pair<double, std::string>& b) {
+		return a.first > b.first;
+	};
+	std::partial_sort(tests.begin(),
+			tests.begin() + std::min(slowestCount, tests.size()),
+			tests.end(), slower);
+	std::partial_sort(suites.begin(),
+			suites.begin() + std::min(slowestCount, suites.size()),
+			suites.end(), slower);
+
+	out << "Slowest tests:" << "\n";
+	for(size_t i = 0; i < tests.size() && i < slowestCount; ++i)
+		out << "   " << tests[i].second << " --> " << tests[i].first <<
+				"ms" << "\n";
+	out << "Slowest suites:" << "\n";
+	for(size_t i = 0; i < suites.size() && i < slowestCount; ++i)
+		out << "   " << suites[i].second << " --> " << suites[i].first <<
+				"ms" << "\n";
+}
+
 class ConsoleCallback : public ControlCallback
 {
 public:
+	ConsoleCallback(size_t slowestCount = 5) :
+		m_SlowestCount(slowestCount)
+	{}
+
 	virtual ~ConsoleCallback() {}
 
 	virtual void OnTestBegin(Test& t)
@@ -341,6 +1087,8 @@ public:
 			std::cout << "Succeeded";
 		else if(t.GetTotalResult() == Result::Fail)
 			std::cout << "Failed";
+		else if(t.GetTotalResult() == Result::Timeout)
+			std::cout << "Timed out";
 
 		std::cout << std::endl;
 
@@ -374,8 +1122,10 @@ public:
 
 	virtual void OnBegin(Environment& env)
 	{}
-	virtual void OnEnd(const Environment& env)
-	{}
+	virtual void OnEnd(const EnvironmentResult& result)
+	{
+		WriteTimingReport(std::cout, result, m_SlowestCount);
+	}
 
 	virtual ControlAction OnException(const Info& ctx)
 	{
@@ -404,6 +1154,126 @@ public:
 
 		return ControlAction::Abort;
 	}
+
+private:
+	size_t m_SlowestCount;
+};
+
+// Console reporter that collects output in a memory buffer and writes it
+// with plain '\n' instead of flushing the stream per line. The buffer is
+// flushed on suite boundaries, when it grows past the limit and at the
+// end of the run, so fast tests are not dominated by write syscalls.
+class BufferedConsoleCallback : public ControlCallback
+{
+public:
+	BufferedConsoleCallback(size_t flushLimit = 64 * 1024,
+			size_t slowestCount = 5) :
+		m_FlushLimit(flushLimit),
+		m_SlowestCount(slowestCount)
+	{}
+
+	virtual ~BufferedConsoleCallback()
+	{
+		Flush();
+	}
+
+	void Flush()
+	{
+		std::cout << m_Buffer.str();
+		m_Buffer.str("");
+	}
+
+	virtual void OnTestBegin(Test& t)
+	{
+		m_Buffer << "   " << t.GetInfo().GetName() << " --> ";
+	}
+
+	virtual bool OnTestEnd(const TestResult& t)
+	{
+		if(t.GetTotalResult() == Result::Success)
+			m_Buffer << "Succeeded";
+		else if(t.GetTotalResult() == Result::Fail)
+			m_Buffer << "Failed";
+		else if(t.GetTotalResult() == Result::Timeout)
+			m_Buffer << "Timed out";
+
+		m_Buffer << '\n';
+
+		if(t.GetTotalResult() == Result::Fail)
+		{
+			for(size_t i = 0; i < t.GetAssertCount(); ++i)
+			{
+				const AssertResult& a = t.GetAssert(i);
+				m_Buffer << "     \"" << a.message << "\" --> ";
+				if(a.GetTotalResult() == Result::Success)
+					m_Buffer << "Succeeded";
+				else if(a.GetTotalResult() == Result::Fail)
+					m_Buffer << "Failed";
+
+				m_Buffer << '\n';
+			}
+		}
+
+		if((size_t)m_Buffer.tellp() >= m_FlushLimit)
+			Flush();
+
+		return false;
+	}
+
+	virtual void OnSuiteBegin(Suite& s)
+	{
+		m_Buffer << "Run Testsuite \"" << s.GetInfo().GetName() << "\":" << '\n';
+	}
+
+	virtual void OnSuiteEnd(const SuiteResult& result)
+	{
+		m_Buffer << '\n';
+		Flush();
+	}
+
+	virtual void OnEnd(const EnvironmentResult& result)
+	{
+		WriteTimingReport(m_Buffer, result, m_SlowestCount);
+		Flush();
+		std::cout.flush();
+	}
+
+	virtual ControlAction OnException(const Info& ctx)
+	{
+		m_Buffer << "Unknown exception was thrown." << '\n';
+		Flush();
+		return ControlAction::AbortCurrent;
+	}
+	virtual ControlAction OnDependencyFail(const Suite& running,
+			const Suite& failed, const SuiteResult& result)
+	{
+		m_Buffer << "Dependency \"" << failed.GetInfo().GetName() <<
+			"\" needed by \"" << running.GetInfo().GetName() << "\" failed." << '\n';
+		Flush();
+		return ControlAction::AbortCurrent;
+	}
+	virtual ControlAction OnUnknownDependency(
+			const Suite& s, const std::string& dep)
+	{
+		m_Buffer << "Missing dependency \"" << dep << "\"." << '\n';
+		Flush();
+		return ControlAction::AbortCurrent;
+	}
+	virtual ControlAction OnUnsolvableDependencies(
+			const Environment& e, const std::vector<const Suite*>& unsolvable)
+	{
+		m_Buffer << "Can not solve dependencies, circle by:" << '\n';
+		for(auto it = unsolvable.begin(); it != unsolvable.end(); ++it)
+			m_Buffer << "   " << (*it)->GetInfo().GetName() << '\n';
+
+		Flush();
+		return ControlAction::Abort;
+	}
+
+private:
+	std::ostringstream m_Buffer;
+	size_t m_FlushLimit;
+	size_t m_SlowestCount;
 };
 
 }
@@ -426,6 +1296,40 @@ void TestFunc_##name(UnitTesting::TestContext&); \
 static UnitTesting::Test Test_##name(Suite, &TestFunc_##name, UnitTesting::Info(#name, "", __LINE__)); \
 void TestFunc_##name(UnitTesting::TestContext& ctx)
 
+#define UNIT_BENCHMARK(name) \
+void TestFunc_##name(UnitTesting::TestContext&); \
+static UnitTesting::Test Test_##name(Suite, &TestFunc_##name, UnitTesting::Info(#name, "", __LINE__), true); \
+void TestFunc_##name(UnitTesting::TestContext& ctx)
+
+// A data-driven test: the framework iterates the given range and calls
+// the body once per case, with `param` bound to the element and
+// `caseCtx` as the per-case context for UNIT_CASE_CHECK.
+#define UNIT_TEST_P(name, ...) \
+typedef UnitTesting::CaseParam<decltype(__VA_ARGS__)>::type CaseParam_##name; \
+void CaseFunc_##name(UnitTesting::CaseContext&, const CaseParam_##name&); \
+void TestFunc_##name(UnitTesting::TestContext& ctx) \
+{ \
+	UnitTesting::RunCases(ctx, (__VA_ARGS__), &CaseFunc_##name, UnitTesting::Info(#name, "", __LINE__)); \
+} \
+static UnitTesting::Test Test_##name(Suite, &TestFunc_##name, UnitTesting::Info(#name, "", __LINE__)); \
+void CaseFunc_##name(UnitTesting::CaseContext& caseCtx, const CaseParam_##name& param)
+
+// Stress tests repeat the body a fixed number of times or until a time
+// budget is spent. Passing iterations only bump a counter, failing
+// iterations are recorded with their iteration index, and iteration
+// timing statistics land in the result's benchmark stats. Use the _EX
+// variant to pass a full StressSpec, e.g. with FixturePerIteration().
+#define UNIT_STRESS_TEST(name, count) \
+UNIT_STRESS_TEST_EX(name, UnitTesting::StressSpec::Count(count))
+
+#define UNIT_STRESS_TEST_TIMED(name, milliseconds) \
+UNIT_STRESS_TEST_EX(name, UnitTesting::StressSpec::Timed(milliseconds))
+
+#define UNIT_STRESS_TEST_EX(name, spec) \
+void TestFunc_##name(UnitTesting::TestContext&); \
+static UnitTesting::Test Test_##name(Suite, &TestFunc_##name, UnitTesting::Info(#name, "", __LINE__), (spec)); \
+void TestFunc_##name(UnitTesting::TestContext& ctx)
+
 #define UNIT_SUITE_INIT \
 void SuiteInitFunc(); \
 static UnitTesting::RegisterInit RegisterSuiteInit(Suite, &SuiteInitFunc, UnitTesting::Info("suite.init", "", __LINE__)); \
@@ -449,4 +1353,14 @@ void SuiteFixtureLeave()
 #define UNIT_ASSERT(cond) do{ ctx.AddResult(UnitTesting::Info("", "", __LINE__), (cond), #cond); }while(false)
 #define UNIT_ASSERT_EX(cond, msg) do{ ctx.AddResult(UnitTesting::Info("", "", __LINE__), (cond), (msg)); }while(false)
 
+#define UNIT_CHECK(cond) do{ if(!ctx.Check((cond))) ctx.CheckFailed(UnitTesting::Info("", "", __LINE__), #cond); }while(false)
+#define UNIT_CHECK_EX(cond, msg) do{ if(!ctx.Check((cond))) ctx.CheckFailed(UnitTesting::Info("", "", __LINE__), (msg)); }while(false)
+
+#define UNIT_CASE_CHECK(cond) do{ if(!caseCtx.Check((cond))) caseCtx.CheckFailed(#cond); }while(false)
+
+// Like UNIT_CHECK_EX, but the message arguments are only evaluated and
+// formatted when the check fails, so loops never pay for string
+// building on passing iterations.
+#define UNIT_CHECK_FMT(cond, ...) do{ if(!ctx.Check((cond))) ctx.CheckFailedFormat(UnitTesting::Info("", "", __LINE__), __VA_ARGS__); }while(false)
+
 #endif
\ No newline at end of file